@@ -33,6 +33,10 @@
 #include <sys/cdefs.h>
 #include <machine/trap.h>
 #include <machine/idt.h>
+#include <machine/msr.h>
+#include <machine/cpuid.h>
+#include <machine/pmap.h>
+#include <vm/vm.h>
 
 #define ISR(func) ((uintptr_t)func)
 
@@ -54,15 +58,171 @@ interrupts_init(struct processor *processor)
     idt_load();
 }
 
+/*
+ * Sends interrupt `vector` to every processor
+ * in the `cpus` mask.
+ *
+ * Returns false if it couldn't be sent. There is
+ * no Local APIC driver to send it with yet, it
+ * overrides this.
+ */
+__weak bool
+processor_send_ipi(uint32_t cpus, uint8_t vector)
+{
+    __USE(cpus);
+    __USE(vector);
+    return false;
+}
+
 void
 processor_halt(void)
 {
     __ASMV("cli; hlt");
 }
 
+/*
+ * Returns the processor we are
+ * currently running on.
+ *
+ * => Must be called after processor_init()
+ */
+struct processor *
+this_processor(void)
+{
+    struct processor *processor;
+
+    __ASMV("mov %%gs:0, %0" : "=r" (processor));
+    return processor;
+}
+
+/*
+ * Records `table` (a table at `level`, where the PT is
+ * level 1) and every table below it into `frames`.
+ *
+ * Returns the running count of tables.
+ */
+static size_t
+processor_walk_table(uintptr_t table, int level, uintptr_t *frames,
+                     size_t max, size_t count)
+{
+    const uint64_t *entries;
+
+    if (count < max) {
+        frames[count] = table;
+    }
+    ++count;
+
+    if (level == 1) {
+        /* Entries of a PT point to pages */
+        return count;
+    }
+
+    entries = PHYS_TO_VIRT(table);
+    for (size_t i = 0; i < 512; ++i) {
+        if (!__TEST(entries[i], PTE_P)) {
+            continue;
+        }
+        if (level <= 3 && __TEST(entries[i], PTE_PS)) {
+            continue;
+        }
+
+        count = processor_walk_table(entries[i] & PTE_ADDR_MASK, level - 1,
+                                     frames, max, count);
+    }
+
+    return count;
+}
+
+/*
+ * Collects the physical addresses of every
+ * translation table reachable from CR3 into
+ * `frames`, storing at most `max` of them.
+ *
+ * Returns the number of tables found, which
+ * may be greater than `max`.
+ */
+size_t
+processor_pagetables(uintptr_t *frames, size_t max)
+{
+    uintptr_t cr3;
+
+    __ASMV("mov %%cr3, %0" : "=r" (cr3));
+    return processor_walk_table(cr3 & PTE_ADDR_MASK, pmap_paging_levels(),
+                                frames, max, 0);
+}
+
+/*
+ * Returns how many page colors the last level
+ * cache has: the bytes of a single way over the
+ * page size. Returns 1 if it can't be found.
+ */
+size_t
+processor_cache_colors(void)
+{
+    uint32_t regs[4];
+    uint32_t eax, ebx, ecx, maxleaf;
+    size_t way_size = 0;
+    int level = 0;
+
+    cpuid(CPUID_VENDOR, 0, regs);
+    maxleaf = regs[0];
+    if (maxleaf < CPUID_CACHE_PARAMS) {
+        return 1;
+    }
+
+    /* Subleafs run from L1 up, keep the highest data cache */
+    for (uint32_t i = 0;; ++i) {
+        cpuid(CPUID_CACHE_PARAMS, i, regs);
+        eax = regs[0];
+        ebx = regs[1];
+        ecx = regs[2];
+
+        if (CPUID_CACHE_TYPE(eax) == 0) {
+            break;
+        }
+        if (CPUID_CACHE_TYPE(eax) == CPUID_CACHE_INSTR) {
+            continue;
+        }
+        if (CPUID_CACHE_LEVEL(eax) >= level) {
+            level = CPUID_CACHE_LEVEL(eax);
+            way_size = (size_t)CPUID_CACHE_LINE(ebx) * CPUID_CACHE_PARTS(ebx) *
+                       CPUID_CACHE_SETS(ecx);
+        }
+    }
+
+    return __MAX(way_size / PAGE_SIZE, 1);
+}
+
+/*
+ * Switches to the stack whose top is `sp`
+ * and calls `func`, which never returns.
+ */
+__dead void
+processor_stack_switch(uintptr_t sp, void(*func)(void))
+{
+    __ASMV("mov %0, %%rsp\n"
+           "xor %%rbp, %%rbp\n"
+           "call *%1"
+           :
+           : "r" (sp), "r" (func)
+           : "memory"
+    );
+
+    __builtin_unreachable();
+}
+
 __weak void
 processor_init(struct processor *processor)
 {
     gdt_load(processor->machdep.gdtr);
+
+    /*
+     * GS always points to the current processor. This
+     * must come after gdt_load() as reloading %gs
+     * clears the base.
+     */
+    processor->self = processor;
+    wrmsr(IA32_GS_BASE, (uintptr_t)processor);
+
     interrupts_init(processor);
 }
@@ -0,0 +1,635 @@
+/*
+ * Copyright (c) 2023 Ian Marco Moffett and the VegaOS team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of VegaOS nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#include <sys/cdefs.h>
+#include <sys/limine.h>
+#include <sys/syslog.h>
+#include <sys/errno.h>
+#include <sys/panic.h>
+#include <machine/cpuid.h>
+#include <machine/msr.h>
+#include <vm/pmap.h>
+#include <vm/vm_physseg.h>
+#include <vm/vm.h>
+
+__MODULE_NAME("pmap");
+__KERNEL_META("$Vega$: pmap.c, Ian Marco Moffett, "
+              "amd64 physical map");
+
+#if defined(PMAP_DEBUG)
+#define DPRINTF(...) KDEBUG(__VA_ARGS__)
+#else
+#define DPRINTF(...) __nothing
+#endif      /* defined(PMAP_DEBUG) */
+
+/* Limine maps at least this much into the HHDM */
+#define PMAP_DIRECT_MIN     0x100000000ULL
+
+#define CR0_WP              __BIT(16)   /* Supervisor write protect */
+#define CR0_NW              __BIT(29)   /* Not write-through */
+#define CR0_CD              __BIT(30)   /* Cache disable */
+
+extern char __text_start[], __text_end[];
+extern char __rodata_start[], __rodata_end[];
+extern char __data_start[], __data_end[];
+
+static volatile struct limine_kernel_address_request kaddr_req = {
+    .id = LIMINE_KERNEL_ADDRESS_REQUEST,
+    .revision = 0
+};
+
+/*
+ * Have the bootloader enter LA57 if the processor
+ * can do it, so the HHDM isn't capped at 128 TiB.
+ */
+__used static volatile struct limine_5_level_paging_request la57_req = {
+    .id = LIMINE_5_LEVEL_PAGING_REQUEST,
+    .revision = 0
+};
+
+static struct pmap kernel_pmap;
+
+/* Translation levels we run with, chosen at boot */
+static int pmap_levels = 4;
+
+/* PTE_NX if the processor has it, 0 otherwise */
+static uint64_t pte_nx = 0;
+
+/* Entry bits selecting write-combining, 0 without a PAT */
+static uint64_t pte_wc = 0;
+
+/*
+ * PAT entries, the same as the power-on defaults
+ * except PWT alone (entry 1, and 5) now selects
+ * write-combining instead of write-through.
+ */
+#define PMAP_PAT                            \
+    (PAT_ENTRY(0, PAT_WB) |                 \
+     PAT_ENTRY(1, PAT_WC) |                 \
+     PAT_ENTRY(2, PAT_UCMINUS) |            \
+     PAT_ENTRY(3, PAT_UC) |                 \
+     PAT_ENTRY(4, PAT_WB) |                 \
+     PAT_ENTRY(5, PAT_WC) |                 \
+     PAT_ENTRY(6, PAT_UCMINUS) |            \
+     PAT_ENTRY(7, PAT_UC))
+
+/* Largest level the direct map may use a huge page at */
+static int direct_max_level = 2;
+
+/*
+ * Turns PMAP_* protection into translation table
+ * entry bits for a mapping within `pmap`.
+ */
+static uint64_t
+pmap_prot_to_pte(struct pmap *pmap, int prot)
+{
+    uint64_t pte;
+
+    pte = PTE_P;
+    if (pmap == &kernel_pmap) {
+        /* Same in every address space */
+        pte |= PTE_G;
+    }
+    if (__TEST(prot, PMAP_WRITABLE)) {
+        pte |= PTE_RW;
+    }
+    if (!__TEST(prot, PMAP_EXEC)) {
+        pte |= pte_nx;
+    }
+    if (__TEST(prot, PMAP_USER)) {
+        pte |= PTE_US;
+    }
+    if (__TEST(prot, PMAP_WC)) {
+        pte |= pte_wc;
+    }
+
+    return pte;
+}
+
+/*
+ * Returns the entry mapping `va` at `level`, where
+ * level 1 is the PT. Missing tables are allocated on
+ * the way down if `alloc` is set.
+ *
+ * Returns NULL if a table is missing (or couldn't be
+ * allocated) or `va` is mapped by a huge page above
+ * `level`.
+ *
+ * => Call with the lock of `pmap` held.
+ */
+static uint64_t *
+pmap_walk(struct pmap *pmap, vaddr_t va, int level, bool alloc)
+{
+    uint64_t *table, *pte, flags;
+    paddr_t phys;
+
+    /*
+     * Leaf entries decide what is actually allowed,
+     * but kernel addresses (the upper half) are never
+     * reachable from user mode to begin with.
+     */
+    flags = PTE_P | PTE_RW;
+    if (!__TEST(va, __BIT(63))) {
+        flags |= PTE_US;
+    }
+
+    table = PHYS_TO_VIRT(pmap->pml4);
+    for (int i = pmap_levels; i > level; --i) {
+        pte = &table[PMAP_INDEX(va, i)];
+
+        if (!__TEST(*pte, PTE_P)) {
+            if (!alloc) {
+                return NULL;
+            }
+            if ((phys = vm_alloc_pageframe(1, VM_ALLOC_ZERO)) == 0) {
+                return NULL;
+            }
+
+            *pte = phys | flags;
+        } else if (__TEST(*pte, PTE_PS)) {
+            return NULL;
+        }
+
+        table = PHYS_TO_VIRT(*pte & PTE_ADDR_MASK);
+    }
+
+    return &table[PMAP_INDEX(va, level)];
+}
+
+/*
+ * Maps a page at `va` to `pa` with protection
+ * `prot` (PMAP_*) within `pmap`.
+ *
+ * Returns 0 on success, EXIT_FAILURE if a table
+ * could not be allocated or `va` is within a
+ * huge page.
+ */
+int
+pmap_enter(struct pmap *pmap, vaddr_t va, paddr_t pa, int prot)
+{
+    uint64_t *pte, old;
+
+    spinlock_acquire(&pmap->lock);
+    if ((pte = pmap_walk(pmap, va, 1, true)) == NULL) {
+        spinlock_release(&pmap->lock);
+        return EXIT_FAILURE;
+    }
+
+    old = *pte;
+    *pte = (pa & PTE_ADDR_MASK) | pmap_prot_to_pte(pmap, prot);
+    spinlock_release(&pmap->lock);
+
+    if (__TEST(old, PTE_P)) {
+        pmap_tlb_shootdown(pmap, va);
+    }
+
+    return 0;
+}
+
+/*
+ * Unmaps the page at `va` within `pmap`,
+ * huge pages are left alone.
+ */
+void
+pmap_remove(struct pmap *pmap, vaddr_t va)
+{
+    uint64_t *pte;
+
+    spinlock_acquire(&pmap->lock);
+    pte = pmap_walk(pmap, va, 1, false);
+    if (pte == NULL || !__TEST(*pte, PTE_P)) {
+        spinlock_release(&pmap->lock);
+        return;
+    }
+
+    *pte = 0;
+    spinlock_release(&pmap->lock);
+    pmap_tlb_shootdown(pmap, va);
+}
+
+/*
+ * Looks up the physical address `va` maps to
+ * within `pmap` and stores it in `pa`.
+ *
+ * Returns true if `va` is mapped.
+ */
+bool
+pmap_extract(struct pmap *pmap, vaddr_t va, paddr_t *pa)
+{
+    const uint64_t *table;
+    uint64_t pte;
+
+    spinlock_acquire(&pmap->lock);
+    table = PHYS_TO_VIRT(pmap->pml4);
+    for (int level = pmap_levels; level > 0; --level) {
+        pte = table[PMAP_INDEX(va, level)];
+        if (!__TEST(pte, PTE_P)) {
+            break;
+        }
+
+        if (level == 1 || __TEST(pte, PTE_PS)) {
+            spinlock_release(&pmap->lock);
+            *pa = (pte & PTE_ADDR_MASK & ~(PMAP_LEVEL_SIZE(level) - 1)) |
+                  (va & (PMAP_LEVEL_SIZE(level) - 1));
+            return true;
+        }
+
+        table = PHYS_TO_VIRT(pte & PTE_ADDR_MASK);
+    }
+
+    spinlock_release(&pmap->lock);
+    return false;
+}
+
+/*
+ * Sets up a new address space in `pmap`, sharing
+ * the kernel's half with every other one.
+ *
+ * Returns 0 on success, EXIT_FAILURE if the top
+ * table could not be allocated.
+ */
+int
+pmap_create(struct pmap *pmap)
+{
+    uint64_t *top, *ktop;
+
+    pmap->pml4 = vm_alloc_pageframe(1, VM_ALLOC_ZERO);
+    if (pmap->pml4 == 0) {
+        return EXIT_FAILURE;
+    }
+
+    /* pmap_init() made sure these never change */
+    top = PHYS_TO_VIRT(pmap->pml4);
+    ktop = PHYS_TO_VIRT(kernel_pmap.pml4);
+    for (size_t i = 256; i < 512; ++i) {
+        top[i] = ktop[i];
+    }
+
+    pmap->pcid = pmap_pcid_alloc();
+    pmap->cpus = 0;
+    pmap->lock = (struct spinlock) { 0 };
+    return 0;
+}
+
+/*
+ * Frees the table at `table` (at `level`)
+ * and every table below it.
+ */
+static void
+pmap_free_tables(paddr_t table, int level)
+{
+    const uint64_t *entries;
+
+    if (level > 1) {
+        entries = PHYS_TO_VIRT(table);
+        for (size_t i = 0; i < 512; ++i) {
+            if (!__TEST(entries[i], PTE_P) || __TEST(entries[i], PTE_PS)) {
+                continue;
+            }
+
+            pmap_free_tables(entries[i] & PTE_ADDR_MASK, level - 1);
+        }
+    }
+
+    vm_free_pageframe(table, 1);
+}
+
+/*
+ * Tears down an address space made by pmap_create(),
+ * the pages it mapped are left to their owners.
+ *
+ * => `pmap` must not be active on any processor.
+ */
+void
+pmap_destroy(struct pmap *pmap)
+{
+    const uint64_t *top;
+
+    if (pmap == &kernel_pmap) {
+        return;
+    }
+
+    /* Only the user half is ours to free */
+    top = PHYS_TO_VIRT(pmap->pml4);
+    for (size_t i = 0; i < 256; ++i) {
+        if (__TEST(top[i], PTE_P)) {
+            pmap_free_tables(top[i] & PTE_ADDR_MASK, pmap_levels - 1);
+        }
+    }
+
+    vm_free_pageframe(pmap->pml4, 1);
+    pmap_pcid_free(pmap->pcid);
+    pmap->pml4 = 0;
+}
+
+/*
+ * Returns the pmap of the kernel.
+ */
+struct pmap *
+pmap_kernel(void)
+{
+    return &kernel_pmap;
+}
+
+/*
+ * Maps `size` bytes of physical memory from 0 into
+ * the HHDM using the biggest pages that fit.
+ */
+static void
+pmap_map_direct(size_t size)
+{
+    uint64_t *pte;
+    paddr_t pa;
+    vaddr_t va;
+    int level;
+
+    pa = 0;
+    spinlock_acquire(&kernel_pmap.lock);
+    while (pa < size) {
+        va = VM_HIGHER_HALF + pa;
+
+        /* Pick the biggest page that is aligned and fits */
+        level = direct_max_level;
+        while (level > 1 && (((va | pa) & (PMAP_LEVEL_SIZE(level) - 1)) != 0
+                             || size - pa < PMAP_LEVEL_SIZE(level))) {
+            --level;
+        }
+
+        if ((pte = pmap_walk(&kernel_pmap, va, level, true)) == NULL) {
+            panic("Could not map the HHDM\n");
+        }
+
+        *pte = pa | PTE_P | PTE_RW | PTE_G | pte_nx;
+        if (level > 1) {
+            *pte |= PTE_PS;
+        }
+        pa += PMAP_LEVEL_SIZE(level);
+    }
+    spinlock_release(&kernel_pmap.lock);
+}
+
+/*
+ * Breaks the huge page mapped by `pte` (at `level`)
+ * up into a table of the next level down, mapping
+ * the same memory the same way.
+ *
+ * Returns 0 on success, EXIT_FAILURE if the table
+ * could not be allocated.
+ *
+ * => Call with the kernel pmap locked.
+ */
+static int
+pmap_split(uint64_t *pte, int level)
+{
+    uint64_t *entries, flags;
+    paddr_t table, pa;
+
+    if ((table = vm_alloc_pageframe(1, VM_ALLOC_ZERO)) == 0) {
+        return EXIT_FAILURE;
+    }
+
+    pa = *pte & PTE_ADDR_MASK;
+    flags = *pte & ~PTE_ADDR_MASK;
+    if (level - 1 == 1) {
+        /* Bit 7 is PAT in a PT entry, we never set it */
+        flags &= ~PTE_PS;
+    }
+
+    entries = PHYS_TO_VIRT(table);
+    for (size_t i = 0; i < 512; ++i) {
+        entries[i] = (pa + i * PMAP_LEVEL_SIZE(level - 1)) | flags;
+    }
+
+    *pte = table | PTE_P | PTE_RW;
+    return 0;
+}
+
+/*
+ * Makes [`pa`, `pa` + `size`) write-combining within
+ * the HHDM, so a framebuffer can be used through it
+ * without a second mapping of another memory type.
+ * Huge pages the range ends within are split up.
+ *
+ * Returns 0 on success, EXIT_FAILURE if there is no
+ * PAT, the range isn't within the HHDM or a table
+ * could not be allocated.
+ */
+int
+pmap_direct_wc(paddr_t pa, size_t size)
+{
+    uint64_t *table, *pte;
+    vaddr_t va, end;
+    int level, error = 0;
+
+    if (pte_wc == 0) {
+        return EXIT_FAILURE;
+    }
+
+    va = VM_HIGHER_HALF + __ALIGN_DOWN(pa, PAGE_SIZE);
+    end = VM_HIGHER_HALF + __ALIGN_UP(pa + size, PAGE_SIZE);
+
+    spinlock_acquire(&kernel_pmap.lock);
+    while (va < end && error == 0) {
+        table = PHYS_TO_VIRT(kernel_pmap.pml4);
+        for (level = pmap_levels; level > 0; --level) {
+            pte = &table[PMAP_INDEX(va, level)];
+            if (!__TEST(*pte, PTE_P)) {
+                error = EXIT_FAILURE;
+                break;
+            }
+
+            if (level > 1 && __TEST(*pte, PTE_PS)) {
+                /* Only split if the range ends within it */
+                if ((va & (PMAP_LEVEL_SIZE(level) - 1)) != 0 ||
+                    end - va < PMAP_LEVEL_SIZE(level)) {
+                    pmap_tlb_shootdown(&kernel_pmap, va);
+                    if ((error = pmap_split(pte, level)) != 0) {
+                        break;
+                    }
+                } else {
+                    *pte |= pte_wc;
+                    pmap_tlb_shootdown(&kernel_pmap, va);
+                    va += PMAP_LEVEL_SIZE(level);
+                    break;
+                }
+            }
+
+            if (level == 1) {
+                *pte |= pte_wc;
+                pmap_tlb_shootdown(&kernel_pmap, va);
+                va += PAGE_SIZE;
+                break;
+            }
+
+            table = PHYS_TO_VIRT(*pte & PTE_ADDR_MASK);
+        }
+    }
+    spinlock_release(&kernel_pmap.lock);
+    pmap_update(&kernel_pmap);
+
+    /* Don't leave write-back lines of it around */
+    __ASMV("wbinvd" ::: "memory");
+    return error;
+}
+
+/*
+ * Loads `pat` into IA32_PAT the way the SDM asks
+ * for: with caching off and the caches and TLB
+ * flushed on both sides of the write.
+ *
+ * => Interrupts must be off.
+ */
+static void
+pmap_set_pat(uint64_t pat)
+{
+    uint64_t cr0, cr3, cr4;
+
+    __ASMV("mov %%cr0, %0" : "=r" (cr0));
+    __ASMV("mov %%cr3, %0" : "=r" (cr3));
+    __ASMV("mov %%cr4, %0" : "=r" (cr4));
+
+    __ASMV("mov %0, %%cr0" :: "r" ((cr0 | CR0_CD) & ~CR0_NW) : "memory");
+    __ASMV("wbinvd" ::: "memory");
+    wrmsr(IA32_PAT, pat);
+    __ASMV("wbinvd" ::: "memory");
+
+    /* Flush the TLB, global entries included */
+    __ASMV("mov %0, %%cr4" :: "r" (cr4 & ~CR4_PGE) : "memory");
+    __ASMV("mov %0, %%cr3" :: "r" (cr3) : "memory");
+    __ASMV("mov %0, %%cr4" :: "r" (cr4) : "memory");
+    __ASMV("mov %0, %%cr0" :: "r" (cr0) : "memory");
+}
+
+/*
+ * Maps the kernel image from `start` to
+ * `end` with protection `prot`.
+ */
+static void
+pmap_map_kernel(const char *start, const char *end, int prot)
+{
+    struct limine_kernel_address_response *kaddr;
+    vaddr_t va;
+    paddr_t pa;
+
+    kaddr = kaddr_req.response;
+    va = __ALIGN_DOWN((vaddr_t)start, PAGE_SIZE);
+    for (; va < (vaddr_t)end; va += PAGE_SIZE) {
+        pa = va - kaddr->virtual_base + kaddr->physical_base;
+        if (pmap_enter(&kernel_pmap, va, pa, prot) != 0) {
+            panic("Could not map the kernel\n");
+        }
+    }
+}
+
+/*
+ * Builds the kernel's own translation tables and
+ * switches to them. The HHDM is kept where the
+ * bootloader put it.
+ *
+ * => Must be called after vm_physseg_init() and
+ *    while the memory map is still around.
+ */
+void
+pmap_init(void)
+{
+    uint32_t regs[4];
+    uint64_t cr0, *top;
+    paddr_t table;
+    size_t direct_size;
+
+    if (kaddr_req.response == NULL) {
+        panic("Kernel address request has no response\n");
+    }
+
+    /*
+     * The bootloader already switched to LA57 if it
+     * could, we keep whatever mode it left us in.
+     */
+    pmap_levels = pmap_paging_levels();
+
+    cpuid(CPUID_EXT_FEATURES, 0, regs);
+    if (__TEST(regs[3], CPUID_EXT_EDX_NX)) {
+        wrmsr(IA32_EFER, rdmsr(IA32_EFER) | EFER_NXE);
+        pte_nx = PTE_NX;
+    }
+    if (__TEST(regs[3], CPUID_EXT_EDX_PDPE1GB)) {
+        direct_max_level = 3;
+    }
+
+    /*
+     * Every processor must use the same
+     * PAT, keep this in sync once APs are up.
+     */
+    cpuid(CPUID_FEATURES, 0, regs);
+    if (__TEST(regs[3], CPUID_EDX_PAT)) {
+        pmap_set_pat(PMAP_PAT);
+        pte_wc = PTE_PWT;
+    }
+
+    kernel_pmap.pml4 = vm_alloc_pageframe(1, VM_ALLOC_ZERO);
+    if (kernel_pmap.pml4 == 0) {
+        panic("Could not allocate the kernel PML4\n");
+    }
+
+    direct_size = __MAX(vm_physseg_top(), PMAP_DIRECT_MIN);
+    direct_size = __ALIGN_UP(direct_size, PMAP_LEVEL_SIZE(2));
+    pmap_map_direct(direct_size);
+
+    pmap_map_kernel(__text_start, __text_end, PMAP_EXEC);
+    pmap_map_kernel(__rodata_start, __rodata_end, 0);
+    pmap_map_kernel(__data_start, __data_end, PMAP_WRITABLE);
+
+    /*
+     * Every pmap shares the top level entries of the
+     * kernel half, fill them all in now so they never
+     * change past here.
+     */
+    top = PHYS_TO_VIRT(kernel_pmap.pml4);
+    for (size_t i = 256; i < 512; ++i) {
+        if (__TEST(top[i], PTE_P)) {
+            continue;
+        }
+        if ((table = vm_alloc_pageframe(1, VM_ALLOC_ZERO)) == 0) {
+            panic("Could not allocate kernel translation tables\n");
+        }
+
+        top[i] = table | PTE_P | PTE_RW;
+    }
+
+    KINFO("%d-level paging, HHDM: %d MiB using %s pages\n", pmap_levels,
+          direct_size >> 20, (direct_max_level == 3) ? "1 GiB" : "2 MiB");
+
+    /* Read-only should mean read-only for us too */
+    __ASMV("mov %%cr0, %0" : "=r" (cr0));
+    __ASMV("mov %0, %%cr0" :: "r" (cr0 | CR0_WP) : "memory");
+    __ASMV("mov %0, %%cr3" :: "r" (kernel_pmap.pml4) : "memory");
+    pmap_tlb_init();
+}
@@ -0,0 +1,462 @@
+/*
+ * Copyright (c) 2023 Ian Marco Moffett and the VegaOS team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of VegaOS nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#include <sys/cdefs.h>
+#include <sys/machdep.h>
+#include <sys/spinlock.h>
+#include <machine/cpuid.h>
+#include <vm/pmap.h>
+
+__KERNEL_META("$Vega$: pmap_tlb.c, Ian Marco Moffett, "
+              "amd64 TLB management");
+
+/*
+ * Pages to invalidate, gathered on the current
+ * processor and flushed by pmap_update() in one
+ * go. Once more than PMAP_TLB_BATCH pages are
+ * queued the whole TLB is flushed instead.
+ */
+struct pmap_tlb_batch {
+    struct pmap *pmap;
+    size_t count;
+    vaddr_t va[PMAP_TLB_BATCH];
+};
+
+/*
+ * Per-processor TLB state.
+ *
+ * `pcid_stale` has a bit set for every PCID whose
+ * entries on this processor may be out of date; the
+ * next pmap_activate() of that PCID flushes them
+ * instead of interrupting the processor right away.
+ * `flush_all` asks for everything to go, global
+ * entries included, for when no IPI could be sent.
+ */
+struct pmap_tlb_cpu {
+    struct pmap *curpmap;
+    struct pmap_tlb_batch batch;
+    struct pmap_tlb_stats stats;
+    uint64_t pcid_stale[PMAP_NPCID / 64];
+    volatile bool flush_all;
+} __cacheline_aligned;
+
+static struct pmap_tlb_cpu tlb_cpu[MAXCPUS];
+static bool pcid_enabled = false;
+
+/*
+ * Shootdown mailbox: the batch being invalidated on
+ * other processors. Each processor in `pending` runs
+ * it from pmap_tlb_intr() and clears its bit, the
+ * sender holds `shootdown_lock` until all have.
+ */
+static struct pmap_tlb_batch shootdown_batch;
+static uint32_t shootdown_pending = 0;
+static struct spinlock shootdown_lock = { 0 };
+
+/* PCIDs in use, PCID 0 is the kernel's */
+static uint64_t pcid_map[PMAP_NPCID / 64] = { 1 };
+static struct spinlock pcid_lock = { 0 };
+
+static inline struct pmap_tlb_cpu *
+pmap_tlb_this(void)
+{
+    return &tlb_cpu[this_processor()->id];
+}
+
+static inline void
+pmap_tlb_invlpg(vaddr_t va)
+{
+    __ASMV("invlpg (%0)" :: "r" (va) : "memory");
+}
+
+/*
+ * Flushes every TLB entry of every PCID,
+ * global ones included.
+ */
+static void
+pmap_tlb_flush_all(void)
+{
+    uint64_t cr4;
+
+    __ASMV("mov %%cr4, %0" : "=r" (cr4));
+    __ASMV("mov %0, %%cr4" :: "r" (cr4 & ~CR4_PGE) : "memory");
+    __ASMV("mov %0, %%cr4" :: "r" (cr4) : "memory");
+}
+
+/*
+ * Flags `pcid` as out of date on processor `cpu`.
+ */
+static inline void
+pmap_pcid_set_stale(uint32_t cpu, uint16_t pcid)
+{
+    __atomic_or_fetch(&tlb_cpu[cpu].pcid_stale[pcid / 64],
+                      __BIT(pcid % 64), __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Returns true if `pcid` was out of date on
+ * processor `cpu`, clearing the flag.
+ */
+static inline bool
+pmap_pcid_take_stale(uint32_t cpu, uint16_t pcid)
+{
+    uint64_t old;
+
+    old = __atomic_fetch_and(&tlb_cpu[cpu].pcid_stale[pcid / 64],
+                             ~__BIT(pcid % 64), __ATOMIC_SEQ_CST);
+    return __TEST(old, __BIT(pcid % 64));
+}
+
+/*
+ * Allocates a PCID for a new pmap.
+ *
+ * Returns 0 if all of them are taken, such a pmap
+ * gets its TLB entries flushed on every switch.
+ */
+uint16_t
+pmap_pcid_alloc(void)
+{
+    uint16_t pcid = 0;
+
+    if (!pcid_enabled) {
+        return 0;
+    }
+
+    spinlock_acquire(&pcid_lock);
+    for (size_t i = 0; i < __ARRAY_COUNT(pcid_map); ++i) {
+        if (pcid_map[i] == ~0ULL) {
+            continue;
+        }
+
+        pcid = i * 64 + __builtin_ctzll(~pcid_map[i]);
+        pcid_map[i] |= __BIT(pcid % 64);
+        break;
+    }
+    spinlock_release(&pcid_lock);
+
+    return pcid;
+}
+
+/*
+ * Releases `pcid`. Whatever processors still have
+ * cached under it gets flushed before it is used
+ * again.
+ */
+void
+pmap_pcid_free(uint16_t pcid)
+{
+    if (pcid == 0) {
+        return;
+    }
+
+    for (uint32_t cpu = 0; cpu < MAXCPUS; ++cpu) {
+        pmap_pcid_set_stale(cpu, pcid);
+    }
+
+    spinlock_acquire(&pcid_lock);
+    pcid_map[pcid / 64] &= ~__BIT(pcid % 64);
+    spinlock_release(&pcid_lock);
+}
+
+/*
+ * Switches the current processor to `pmap`.
+ *
+ * With PCIDs the TLB entries of the new pmap
+ * are kept, unless they have gone stale.
+ */
+void
+pmap_activate(struct pmap *pmap)
+{
+    struct pmap_tlb_cpu *cpu;
+    uint32_t id;
+    uint64_t cr3;
+
+    id = this_processor()->id;
+    cpu = &tlb_cpu[id];
+
+    /*
+     * Publish the switch before checking for stale
+     * entries; a shootdown either sees us running
+     * `pmap` or has its stale flag seen by us.
+     */
+    __atomic_store_n(&cpu->curpmap, pmap, __ATOMIC_SEQ_CST);
+    __atomic_or_fetch(&pmap->cpus, __BIT(id), __ATOMIC_SEQ_CST);
+
+    if (__atomic_exchange_n(&cpu->flush_all, false, __ATOMIC_SEQ_CST)) {
+        pmap_tlb_flush_all();
+        ++cpu->stats.flushes;
+    }
+
+    cr3 = pmap->pml4;
+    if (pcid_enabled) {
+        cr3 |= pmap->pcid;
+
+        if (pmap->pcid == 0 && pmap != pmap_kernel()) {
+            /*
+             * No PCID of its own, always start over. Its
+             * entries are tagged with the kernel's PCID
+             * so the kernel pmap can't keep them either.
+             */
+            pmap_pcid_set_stale(id, 0);
+            ++cpu->stats.flushes;
+        } else if (pmap_pcid_take_stale(id, pmap->pcid)) {
+            ++cpu->stats.flushes;
+        } else {
+            cr3 |= CR3_NOFLUSH;
+        }
+    }
+
+    __ASMV("mov %0, %%cr3" :: "r" (cr3) : "memory");
+}
+
+/*
+ * Invalidates the pages of `batch` on
+ * the current processor.
+ */
+static void
+pmap_tlb_flush_local(struct pmap_tlb_cpu *cpu,
+                     const struct pmap_tlb_batch *batch)
+{
+    struct pmap *pmap = batch->pmap;
+
+    if (pmap != pmap_kernel() && cpu->curpmap != pmap) {
+        /* Not running it, catch up on the next switch */
+        if (pcid_enabled) {
+            pmap_pcid_set_stale(this_processor()->id, pmap->pcid);
+        }
+        return;
+    }
+
+    if (batch->count > PMAP_TLB_BATCH) {
+        pmap_tlb_flush_all();
+        ++cpu->stats.flushes;
+        return;
+    }
+
+    for (size_t i = 0; i < batch->count; ++i) {
+        pmap_tlb_invlpg(batch->va[i]);
+    }
+    cpu->stats.pages += batch->count;
+}
+
+/*
+ * Works out which other processors have to
+ * invalidate the queued pages right away.
+ *
+ * Returns a mask of processors to interrupt.
+ */
+static uint32_t
+pmap_tlb_flush_remote(struct pmap *pmap, uint32_t self)
+{
+    uint32_t cpus, targets;
+
+    targets = 0;
+    cpus = __atomic_load_n(&pmap->cpus, __ATOMIC_SEQ_CST) & ~__BIT(self);
+    for (uint32_t cpu = 0; cpus != 0; ++cpu, cpus >>= 1) {
+        if (!__TEST(cpus, 1)) {
+            continue;
+        }
+
+        /* Kernel mappings are cached everywhere */
+        if (pmap == pmap_kernel()) {
+            targets |= __BIT(cpu);
+            continue;
+        }
+
+        /*
+         * Flag it stale first, then look again in case
+         * `pmap` got switched to in the meantime.
+         */
+        pmap_pcid_set_stale(cpu, pmap->pcid);
+        if (__atomic_load_n(&tlb_cpu[cpu].curpmap, __ATOMIC_SEQ_CST) == pmap) {
+            targets |= __BIT(cpu);
+        }
+    }
+
+    return targets;
+}
+
+/*
+ * Publishes the batch of `cpu` and interrupts every
+ * processor in `targets`, returning once they have
+ * all invalidated it.
+ *
+ * If the IPI can't be sent there is nothing to wait
+ * for; the targets flush everything on their next
+ * pmap_activate() instead.
+ *
+ * => Interrupts must be enabled, another processor
+ *    may be waiting on us with the lock held.
+ */
+static void
+pmap_tlb_send(struct pmap_tlb_cpu *cpu, uint32_t targets)
+{
+    spinlock_acquire(&shootdown_lock);
+    shootdown_batch = cpu->batch;
+    __atomic_store_n(&shootdown_pending, targets, __ATOMIC_SEQ_CST);
+
+    if (processor_send_ipi(targets, PMAP_TLB_VECTOR)) {
+        ++cpu->stats.ipis;
+        while (__atomic_load_n(&shootdown_pending, __ATOMIC_SEQ_CST) != 0) {
+            __ASMV("pause");
+        }
+    } else {
+        for (uint32_t i = 0; i < MAXCPUS; ++i) {
+            if (__TEST(targets, __BIT(i))) {
+                __atomic_store_n(&tlb_cpu[i].flush_all, true,
+                                 __ATOMIC_SEQ_CST);
+            }
+        }
+        __atomic_store_n(&shootdown_pending, 0, __ATOMIC_SEQ_CST);
+    }
+
+    spinlock_release(&shootdown_lock);
+}
+
+/*
+ * Runs a TLB shootdown on the current processor,
+ * called by the PMAP_TLB_VECTOR handler.
+ */
+void
+pmap_tlb_intr(void)
+{
+    struct pmap_tlb_cpu *cpu;
+    uint32_t id;
+
+    id = this_processor()->id;
+    cpu = &tlb_cpu[id];
+
+    if (!__TEST(__atomic_load_n(&shootdown_pending, __ATOMIC_SEQ_CST),
+                __BIT(id))) {
+        return;
+    }
+
+    pmap_tlb_flush_local(cpu, &shootdown_batch);
+    __atomic_and_fetch(&shootdown_pending, ~__BIT(id), __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Queues `va` of `pmap` for invalidation,
+ * done on the next pmap_update().
+ */
+void
+pmap_tlb_shootdown(struct pmap *pmap, vaddr_t va)
+{
+    struct pmap_tlb_cpu *cpu;
+    struct pmap_tlb_batch *batch;
+
+    cpu = pmap_tlb_this();
+    batch = &cpu->batch;
+
+    /* A batch only covers a single pmap */
+    if (batch->count > 0 && batch->pmap != pmap) {
+        pmap_update(batch->pmap);
+    }
+
+    batch->pmap = pmap;
+    if (batch->count < PMAP_TLB_BATCH) {
+        batch->va[batch->count] = va;
+    }
+    if (batch->count <= PMAP_TLB_BATCH) {
+        ++batch->count;
+    }
+}
+
+/*
+ * Completes deferred invalidations, stale
+ * translations are gone once this returns.
+ */
+void
+pmap_update(struct pmap *pmap)
+{
+    struct pmap_tlb_cpu *cpu;
+    uint32_t self, targets;
+
+    __USE(pmap);
+
+    cpu = pmap_tlb_this();
+    if (cpu->batch.count == 0) {
+        return;
+    }
+
+    self = this_processor()->id;
+    pmap_tlb_flush_local(cpu, &cpu->batch);
+    targets = pmap_tlb_flush_remote(cpu->batch.pmap, self);
+
+    if (targets != 0) {
+        pmap_tlb_send(cpu, targets);
+    }
+
+    cpu->batch.count = 0;
+    cpu->batch.pmap = NULL;
+}
+
+/*
+ * Fetches TLB statistics for processor `cpu`.
+ */
+void
+pmap_tlb_stats(uint32_t cpu, struct pmap_tlb_stats *res)
+{
+    if (cpu >= MAXCPUS) {
+        return;
+    }
+
+    res->flushes = tlb_cpu[cpu].stats.flushes;
+    res->ipis = tlb_cpu[cpu].stats.ipis;
+    res->pages = tlb_cpu[cpu].stats.pages;
+}
+
+/*
+ * Enables global pages and, where supported,
+ * PCIDs, then runs on the kernel pmap.
+ *
+ * => The kernel pmap must already be loaded
+ *    into CR3.
+ */
+void
+pmap_tlb_init(void)
+{
+    uint32_t regs[4];
+    uint64_t cr4;
+
+    cpuid(CPUID_FEATURES, 0, regs);
+    __ASMV("mov %%cr4, %0" : "=r" (cr4));
+
+    cr4 |= CR4_PGE;
+    if (__TEST(regs[2], CPUID_ECX_PCID)) {
+        /* Only allowed while CR3 holds PCID 0 */
+        cr4 |= CR4_PCIDE;
+        pcid_enabled = true;
+    }
+
+    __ASMV("mov %0, %%cr4" :: "r" (cr4) : "memory");
+    pmap_activate(pmap_kernel());
+}
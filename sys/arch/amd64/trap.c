@@ -34,6 +34,7 @@
 #include <sys/spinlock.h>
 #include <sys/syslog.h>
 #include <sys/panic.h>
+#include <vm/vm_fault.h>
 
 static const char *trap_type[] = {
     [TRAP_BREAKPOINT]   = "breakpoint",
@@ -81,6 +82,51 @@ register_ftrap_handler(ftrap_handler_t handler)
     spinlock_release(&ftrap_handler_lock);
 }
 
+/*
+ * Tries to resolve a page fault, only returning
+ * if the faulting access can be retried.
+ */
+static void
+trap_pagefault(struct trapframe *tf)
+{
+    uintptr_t cr2;
+    int access = 0;
+
+    __ASMV("mov %%cr2, %0" : "=r" (cr2));
+
+    if (__TEST(tf->error_code, PGFLT_W)) {
+        access |= VM_FAULT_WRITE;
+    }
+    if (__TEST(tf->error_code, PGFLT_I)) {
+        access |= VM_FAULT_EXEC;
+    }
+    if (__TEST(tf->error_code, PGFLT_U)) {
+        access |= VM_FAULT_USER;
+    }
+    if (__TEST(tf->error_code, PGFLT_P | PGFLT_RSVD)) {
+        access |= VM_FAULT_PROT;
+    }
+
+    if (vm_fault(cr2, access) == 0) {
+        return;
+    }
+
+    trap_print(tf);
+    kprintf("Faulting address: 0x%x\n", cr2);
+    kprintf("%s %s, %s (rip=0x%x)\n",
+            __TEST(tf->error_code, PGFLT_U) ? "user" : "supervisor",
+            __TEST(tf->error_code, PGFLT_I) ? "fetch" :
+            __TEST(tf->error_code, PGFLT_W) ? "write" : "read",
+            __TEST(tf->error_code, PGFLT_P) ? "protection violation" :
+            "page not present", tf->rip);
+
+    if (__TEST(tf->error_code, PGFLT_RSVD)) {
+        kprintf("Reserved bit set in a paging structure\n");
+    }
+
+    panic("Invalid memory access\n");
+}
+
 /*
  * Handles traps.
  *
@@ -89,6 +135,11 @@ register_ftrap_handler(ftrap_handler_t handler)
 void
 trap_handler(struct trapframe *tf)
 {
+    if (tf->trapno == TRAP_PAGEFLT) {
+        trap_pagefault(tf);
+        return;
+    }
+
     trap_print(tf);
 
     /*
@@ -30,8 +30,16 @@
 /* $Id$ */
 
 #include <sys/types.h>
+#include <sys/cdefs.h>
 #include <sys/limine.h>
+#include <sys/syslog.h>
 #include <dev/video/fbdev.h>
+#include <vm/pmap.h>
+#include <vm/vm.h>
+
+__MODULE_NAME("fbdev");
+__KERNEL_META("$Vega$: fbdev.c, Ian Marco Moffett, "
+              "Framebuffer device");
 
 #define FRAMEBUFFER \
         framebuffer_req.response->framebuffers[0]
@@ -41,15 +49,48 @@ static volatile struct limine_framebuffer_request framebuffer_req = {
     .revision = 0
 };
 
+/*
+ * The framebuffer response lives in bootloader
+ * reclaimable memory, so it is only read once.
+ */
+static struct fbdev front;
+static bool have_front = false;
+
 struct fbdev
 fbdev_get_front(void)
 {
-    struct fbdev ret;
+    if (!have_front) {
+        front.mem = FRAMEBUFFER->address;
+        front.width = FRAMEBUFFER->width;
+        front.height = FRAMEBUFFER->height;
+        front.pitch = FRAMEBUFFER->pitch;
+        have_front = true;
+    }
+
+    return front;
+}
+
+/*
+ * Makes the front buffer write-combining, the
+ * bootloader's mapping is often uncached which makes
+ * every pixel store a bus transaction. The memory
+ * type is changed in the HHDM itself so there is
+ * never a second mapping of it of another type.
+ */
+void
+fbdev_init(void)
+{
+    paddr_t phys;
+    size_t size;
+
+    fbdev_get_front();
+    phys = VIRT_TO_PHYS(front.mem);
+    size = front.pitch * front.height;
 
-    ret.mem = FRAMEBUFFER->address;
-    ret.width = FRAMEBUFFER->width;
-    ret.height = FRAMEBUFFER->height;
-    ret.pitch = FRAMEBUFFER->pitch;
-    return ret;
+    if (pmap_direct_wc(phys, size) != 0) {
+        KINFO("Could not make the framebuffer write-combining\n");
+        return;
+    }
 
+    KINFO("%d KiB write-combining framebuffer at 0x%x\n", size >> 10, phys);
 }
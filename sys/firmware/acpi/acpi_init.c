@@ -37,6 +37,8 @@
 #include <sys/panic.h>
 #include <sys/syslog.h>
 #include <vm/vm.h>
+#include <vm/vm_physseg.h>
+#include <string.h>
 
 __MODULE_NAME("acpi");
 __KERNEL_META("$Vega$: acpi_init.c, Ian Macro Moffett, "
@@ -51,6 +53,13 @@ static size_t root_sdt_entries = 0;
 static bool using_xsdt = false;
 static struct acpi_root_sdt *root_sdt = NULL;
 
+/*
+ * Kernel owned copies of every table, so the
+ * firmware copies can be reclaimed after boot.
+ */
+static struct acpi_header **tables = NULL;
+static size_t ntables = 0;
+
 /*
  * Writes out OEMID of ACPI header.
  *
@@ -84,6 +93,158 @@ acpi_is_checksum_valid(struct acpi_header *hdr)
     return sum == 0;
 }
 
+static bool
+acpi_sig_equal(const struct acpi_header *hdr, const char *sig)
+{
+    const char *hdr_sig = (const char *)&hdr->signature;
+
+    for (size_t i = 0; i < sizeof(hdr->signature); ++i) {
+        if (hdr_sig[i] != sig[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void
+acpi_fix_checksum(struct acpi_header *hdr)
+{
+    uint8_t sum;
+
+    sum = 0;
+    hdr->checksum = 0;
+    for (size_t i = 0; i < hdr->length; ++i) {
+        sum += ((uint8_t *)hdr)[i];
+    }
+
+    hdr->checksum = -sum;
+}
+
+/*
+ * Copies the table at physical address `phys`
+ * into kernel owned memory.
+ *
+ * Returns the copy, or NULL on failure.
+ */
+static struct acpi_header *
+acpi_copy_table(uintptr_t phys)
+{
+    struct acpi_header *hdr;
+    uintptr_t copy;
+
+    hdr = PHYS_TO_VIRT(phys);
+    copy = vm_alloc_pageframe(__DIV_ROUNDUP(hdr->length, PAGE_SIZE), 0);
+    if (copy == 0) {
+        return NULL;
+    }
+
+    memcpy(PHYS_TO_VIRT(copy), hdr, hdr->length);
+    return PHYS_TO_VIRT(copy);
+}
+
+/*
+ * Copies the root SDT and every table it points to,
+ * as well as the DSDT, out of firmware memory. The
+ * entries of the root SDT copy are patched to point
+ * at the table copies, and the FADT copy at the DSDT
+ * copy.
+ *
+ * An RSDT can only hold 32-bit addresses, entries for
+ * copies above 4 GiB are zeroed. Those tables can
+ * still be found with acpi_query().
+ */
+static void
+acpi_copy_tables(void)
+{
+    struct acpi_header *hdr;
+    struct acpi_fadt *fadt;
+    uintptr_t phys, table_list;
+    size_t list_size;
+    uint64_t *xsdt_entries;
+    uint32_t *rsdt_entries;
+
+    list_size = (root_sdt_entries + 1) * sizeof(*tables);
+    table_list = vm_alloc_pageframe(__DIV_ROUNDUP(list_size, PAGE_SIZE), 0);
+    if (table_list == 0) {
+        panic("Could not allocate ACPI table list\n");
+    }
+
+    tables = PHYS_TO_VIRT(table_list);
+    if ((hdr = acpi_copy_table(VIRT_TO_PHYS(root_sdt))) == NULL) {
+        panic("Could not copy root SDT\n");
+    }
+    root_sdt = (struct acpi_root_sdt *)hdr;
+    /* The entries follow the header */
+    xsdt_entries = (void *)((uint8_t *)root_sdt + sizeof(root_sdt->hdr));
+    rsdt_entries = (void *)xsdt_entries;
+
+    for (size_t i = 0; i < root_sdt_entries; ++i) {
+        if (using_xsdt) {
+            phys = xsdt_entries[i];
+        } else {
+            phys = rsdt_entries[i];
+        }
+
+        if ((hdr = acpi_copy_table(phys)) == NULL) {
+            panic("Could not copy ACPI table\n");
+        }
+        tables[ntables++] = hdr;
+
+        /* Point the root SDT copy at our copy */
+        phys = VIRT_TO_PHYS(hdr);
+        if (using_xsdt) {
+            xsdt_entries[i] = phys;
+        } else {
+            rsdt_entries[i] = (phys <= 0xFFFFFFFF) ? phys : 0;
+        }
+
+        if (!acpi_sig_equal(hdr, "FACP")) {
+            continue;
+        }
+
+        /* The DSDT is only referenced by the FADT */
+        fadt = (struct acpi_fadt *)hdr;
+        phys = fadt->dsdt;
+        if (fadt->hdr.length >= sizeof(*fadt) && fadt->x_dsdt != 0) {
+            phys = fadt->x_dsdt;
+        }
+
+        if ((hdr = acpi_copy_table(phys)) == NULL) {
+            panic("Could not copy DSDT\n");
+        }
+        tables[ntables++] = hdr;
+
+        phys = VIRT_TO_PHYS(hdr);
+        fadt->dsdt = (phys <= 0xFFFFFFFF) ? phys : 0;
+        if (fadt->hdr.length >= sizeof(*fadt)) {
+            fadt->x_dsdt = phys;
+        }
+        acpi_fix_checksum(&fadt->hdr);
+    }
+
+    acpi_fix_checksum(&root_sdt->hdr);
+}
+
+/*
+ * Looks up an ACPI table by its
+ * signature (e.g "APIC").
+ *
+ * Returns the table, or NULL if
+ * there is none.
+ */
+struct acpi_header *
+acpi_query(const char *sig)
+{
+    for (size_t i = 0; i < ntables; ++i) {
+        if (acpi_sig_equal(tables[i], sig)) {
+            return tables[i];
+        }
+    }
+
+    return NULL;
+}
+
 void
 acpi_init(void)
 {
@@ -110,5 +271,8 @@ acpi_init(void)
     if (!acpi_is_checksum_valid(&root_sdt->hdr)) {
         panic("Root SDT has an invalid checksum!\n");
     }
-    root_sdt_entries = (root_sdt->hdr.length - sizeof(root_sdt->hdr)) / 4;
+    root_sdt_entries = (root_sdt->hdr.length - sizeof(root_sdt->hdr));
+    root_sdt_entries /= using_xsdt ? sizeof(uint64_t) : sizeof(uint32_t);
+
+    acpi_copy_tables();
 }
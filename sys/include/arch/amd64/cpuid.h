@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2023 Ian Marco Moffett and the VegaOS team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of VegaOS nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef _AMD64_CPUID_H_
+#define _AMD64_CPUID_H_
+
+#include <sys/types.h>
+#include <sys/cdefs.h>
+
+/* Leaves */
+#define CPUID_VENDOR            0x00000000  /* EAX: Highest basic leaf */
+#define CPUID_FEATURES          0x00000001
+#define CPUID_CACHE_PARAMS      0x00000004  /* One subleaf per cache */
+#define CPUID_EXT_FEATURES      0x80000001
+
+/* CPUID_FEATURES bits (ECX) */
+#define CPUID_ECX_PCID          __BIT(17)   /* Process-context identifiers */
+
+/* CPUID_FEATURES bits (EDX) */
+#define CPUID_EDX_PAT           __BIT(16)   /* Page attribute table */
+
+/* CPUID_EXT_FEATURES bits (EDX) */
+#define CPUID_EXT_EDX_NX        __BIT(20)   /* No-execute pages */
+#define CPUID_EXT_EDX_PDPE1GB   __BIT(26)   /* 1 GiB pages */
+
+/* CPUID_CACHE_PARAMS fields */
+#define CPUID_CACHE_TYPE(eax)       ((eax) & 0x1F)          /* 0: No more caches */
+#define CPUID_CACHE_LEVEL(eax)      (((eax) >> 5) & 0x7)
+#define CPUID_CACHE_LINE(ebx)       (((ebx) & 0xFFF) + 1)
+#define CPUID_CACHE_PARTS(ebx)      ((((ebx) >> 12) & 0x3FF) + 1)
+#define CPUID_CACHE_WAYS(ebx)       ((((ebx) >> 22) & 0x3FF) + 1)
+#define CPUID_CACHE_SETS(ecx)       ((ecx) + 1)
+
+#define CPUID_CACHE_INSTR           2       /* Instruction cache type */
+
+/*
+ * Runs CPUID for `leaf` and `subleaf`, storing
+ * EAX, EBX, ECX and EDX into `regs` in that order.
+ */
+static inline void
+cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+    __ASMV("cpuid"
+           : "=a" (regs[0]), "=b" (regs[1]), "=c" (regs[2]), "=d" (regs[3])
+           : "a" (leaf), "c" (subleaf)
+    );
+}
+
+#endif  /* !_AMD64_CPUID_H_ */
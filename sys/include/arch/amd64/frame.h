@@ -105,6 +105,7 @@ struct trapframe {
     pop %r8
     pop %r9
     pop %r10
+    pop %r11
     pop %r12
     pop %r13
     pop %r14
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2023 Ian Marco Moffett and the VegaOS team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of VegaOS nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef _AMD64_PMAP_H_
+#define _AMD64_PMAP_H_
+
+#include <sys/types.h>
+#include <sys/cdefs.h>
+#include <sys/spinlock.h>
+
+/* Translation table entry bits */
+#define PTE_P           __BIT(0)        /* Present */
+#define PTE_RW          __BIT(1)        /* Writable */
+#define PTE_US          __BIT(2)        /* User accessible */
+#define PTE_PWT         __BIT(3)        /* PAT index bit 0 */
+#define PTE_PCD         __BIT(4)        /* PAT index bit 1 */
+#define PTE_PS          __BIT(7)        /* Maps a huge page */
+#define PTE_G           __BIT(8)        /* Global, kept across CR3 loads */
+#define PTE_NX          __BIT(63)       /* No execute */
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000ULL
+
+/* PAT memory types */
+#define PAT_UC          0x00            /* Uncacheable */
+#define PAT_WC          0x01            /* Write-combining */
+#define PAT_WT          0x04            /* Write-through */
+#define PAT_WP          0x05            /* Write-protected */
+#define PAT_WB          0x06            /* Write-back */
+#define PAT_UCMINUS     0x07            /* Uncacheable, MTRRs may override */
+
+/* Memory type of PAT entry `index` */
+#define PAT_ENTRY(index, type) ((uint64_t)(type) << ((index) * 8))
+
+#define CR3_NOFLUSH     __BIT(63)       /* Keep TLB entries of the new PCID */
+#define CR4_PGE         __BIT(7)        /* Global pages */
+#define CR4_LA57        __BIT(12)       /* 5-level paging */
+#define CR4_PCIDE       __BIT(17)       /* Process-context identifiers */
+
+/* Number of PCIDs, 0 belongs to the kernel pmap */
+#define PMAP_NPCID      4096
+
+/* Pages queued for invalidation before a full flush is cheaper */
+#define PMAP_TLB_BATCH  32
+
+/* Interrupt vector of TLB shootdown IPIs */
+#define PMAP_TLB_VECTOR 0xF0
+
+/* Index of `va` within a table at `level` (1 is the PT) */
+#define PMAP_INDEX(va, level) \
+    (((va) >> (12 + 9 * ((level) - 1))) & 0x1FF)
+
+/* Bytes mapped by a single entry at `level` */
+#define PMAP_LEVEL_SIZE(level) (1ULL << (12 + 9 * ((level) - 1)))
+
+/*
+ * Returns the number of translation levels in
+ * use: 5 with LA57 (PML5 on top), 4 otherwise.
+ */
+static inline int
+pmap_paging_levels(void)
+{
+    uint64_t cr4;
+
+    __ASMV("mov %%cr4, %0" : "=r" (cr4));
+    return __TEST(cr4, CR4_LA57) ? 5 : 4;
+}
+
+struct pmap {
+    paddr_t pml4;               /* Physical address of the top table (PML4/PML5) */
+    uint16_t pcid;              /* TLB tag, 0 if none could be assigned */
+    uint32_t cpus;              /* Processors that may cache translations */
+    struct spinlock lock;
+};
+
+struct pmap_tlb_stats {
+    size_t flushes;             /* Full (or whole PCID) flushes */
+    size_t ipis;                /* Shootdown IPIs sent */
+    size_t pages;               /* Pages invalidated with invlpg */
+};
+
+void pmap_tlb_init(void);
+void pmap_tlb_shootdown(struct pmap *pmap, vaddr_t va);
+void pmap_tlb_intr(void);
+uint16_t pmap_pcid_alloc(void);
+void pmap_pcid_free(uint16_t pcid);
+void pmap_tlb_stats(uint32_t cpu, struct pmap_tlb_stats *res);
+
+#endif  /* !_AMD64_PMAP_H_ */
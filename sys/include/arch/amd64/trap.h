@@ -34,6 +34,7 @@
 
 #if !defined(__ASSEMBLER__)
 #include <sys/types.h>
+#include <sys/cdefs.h>
 #include <machine/frame.h>
 #endif      /* !defined(__ASSEMBLER__) */
 
@@ -52,6 +53,13 @@
 /* Trap is coming from user mode */
 #define TRAP_USER           0x100
 
+/* Page fault error code bits */
+#define PGFLT_P             __BIT(0)    /* Page was present */
+#define PGFLT_W             __BIT(1)    /* Write access */
+#define PGFLT_U             __BIT(2)    /* From user mode */
+#define PGFLT_RSVD          __BIT(3)    /* Reserved bit set in an entry */
+#define PGFLT_I             __BIT(4)    /* Instruction fetch */
+
 #if !defined(__ASSEMBLER__)
 typedef void(*ftrap_handler_t)(void);
 
@@ -48,5 +48,6 @@ fbdev_get_index(const struct fbdev *fbdev, uint32_t x, uint32_t y)
 }
 
 struct fbdev fbdev_get_front(void);
+void fbdev_init(void);
 
 #endif  /* !_FBDEV_H_ */
@@ -33,7 +33,9 @@
 #define _ACPI_ACPI_H_
 
 #include <sys/types.h>
+#include <firmware/acpi/tables.h>
 
 void acpi_init(void);
+struct acpi_header *acpi_query(const char *sig);
 
 #endif      /* !_ACPI_ACPI_H_ */
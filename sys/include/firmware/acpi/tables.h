@@ -73,4 +73,18 @@ struct __packed acpi_root_sdt {
     void *entries;              /* 8*n */
 };
 
+/*
+ * Fixed ACPI Description Table (FACP).
+ *
+ * XXX: Only the fields we use are named for now.
+ */
+struct __packed acpi_fadt {
+    struct acpi_header hdr;
+    uint32_t firmware_ctrl;     /* FACS physical address */
+    uint32_t dsdt;              /* DSDT physical address */
+    uint8_t unused[88];         /* Power management fields */
+    uint64_t x_firmware_ctrl;   /* 64-bit FACS physical address */
+    uint64_t x_dsdt;            /* 64-bit DSDT physical address */
+};
+
 #endif      /* !_ACPI_TABLES_H_ */
@@ -34,6 +34,20 @@
 
 #include <sys/types.h>
 #include <sys/cdefs.h>
+#include <string.h>
+
+/*
+ * The range and search helpers below work on whole
+ * 64-bit words, bitmaps used with them must be 8 byte
+ * aligned. On little endian machines bit `n` of the
+ * bitmap is bit `n % 64` of word `n / 64`, the same
+ * bit the byte-wise helpers use.
+ */
+#define BITMAP_WORD_BITS    64
+#define BITMAP_WORD_FULL    ((uint64_t)~0ULL)
+
+/* Returned by the search helpers when nothing is found (SIZE_MAX) */
+#define BITMAP_NONE         ((size_t)-1)
 
 typedef uint8_t *bitmap_t;
 
@@ -55,4 +69,219 @@ bitmap_test_bit(bitmap_t bitmap, size_t bit)
     return __TEST(bitmap[bit / 8], __BIT(bit % 8));
 }
 
+/*
+ * Returns a word with bits [`lo`, `hi`) set,
+ * where 0 <= lo <= hi <= 64.
+ */
+static inline uint64_t
+bitmap_word_mask(size_t lo, size_t hi)
+{
+    uint64_t mask;
+
+    mask = (hi >= BITMAP_WORD_BITS) ? BITMAP_WORD_FULL : __MASK(hi);
+    return mask & ~__MASK(lo);
+}
+
+/*
+ * Sets `count` bits starting at `start`.
+ */
+static inline void
+bitmap_set_range(bitmap_t bitmap, size_t start, size_t count)
+{
+    uint64_t *words = (uint64_t *)bitmap;
+    size_t first, last, end;
+
+    if (count == 0) {
+        return;
+    }
+
+    end = start + count;
+    first = start / BITMAP_WORD_BITS;
+    last = (end - 1) / BITMAP_WORD_BITS;
+
+    if (first == last) {
+        words[first] |= bitmap_word_mask(start % BITMAP_WORD_BITS,
+                                         end - first*BITMAP_WORD_BITS);
+        return;
+    }
+
+    words[first] |= bitmap_word_mask(start % BITMAP_WORD_BITS,
+                                     BITMAP_WORD_BITS);
+    memset(&words[first + 1], 0xFF, (last - first - 1) * sizeof(uint64_t));
+    words[last] |= bitmap_word_mask(0, end - last*BITMAP_WORD_BITS);
+}
+
+/*
+ * Clears `count` bits starting at `start`.
+ */
+static inline void
+bitmap_clear_range(bitmap_t bitmap, size_t start, size_t count)
+{
+    uint64_t *words = (uint64_t *)bitmap;
+    size_t first, last, end;
+
+    if (count == 0) {
+        return;
+    }
+
+    end = start + count;
+    first = start / BITMAP_WORD_BITS;
+    last = (end - 1) / BITMAP_WORD_BITS;
+
+    if (first == last) {
+        words[first] &= ~bitmap_word_mask(start % BITMAP_WORD_BITS,
+                                          end - first*BITMAP_WORD_BITS);
+        return;
+    }
+
+    words[first] &= ~bitmap_word_mask(start % BITMAP_WORD_BITS,
+                                      BITMAP_WORD_BITS);
+    memset(&words[first + 1], 0, (last - first - 1) * sizeof(uint64_t));
+    words[last] &= ~bitmap_word_mask(0, end - last*BITMAP_WORD_BITS);
+}
+
+/*
+ * Fetches word `w` with every bit outside
+ * of [`start`, `end`) forced on.
+ */
+static inline uint64_t
+bitmap_fetch_word(bitmap_t bitmap, size_t w, size_t start, size_t end)
+{
+    uint64_t word;
+    size_t base;
+
+    word = ((uint64_t *)bitmap)[w];
+    base = w * BITMAP_WORD_BITS;
+
+    if (start > base) {
+        word |= bitmap_word_mask(0, start - base);
+    }
+    if (end < base + BITMAP_WORD_BITS) {
+        word |= bitmap_word_mask(end - base, BITMAP_WORD_BITS);
+    }
+
+    return word;
+}
+
+/*
+ * Finds the first clear bit in [`start`, `end`).
+ *
+ * Returns the bit, or BITMAP_NONE if every
+ * bit is set.
+ */
+static inline size_t
+bitmap_find_first_zero(bitmap_t bitmap, size_t start, size_t end)
+{
+    uint64_t word;
+
+    for (size_t w = start / BITMAP_WORD_BITS;
+         w * BITMAP_WORD_BITS < end; ++w) {
+        word = bitmap_fetch_word(bitmap, w, start, end);
+        if (word != BITMAP_WORD_FULL) {
+            return w*BITMAP_WORD_BITS + __builtin_ctzll(~word);
+        }
+    }
+
+    return BITMAP_NONE;
+}
+
+/*
+ * Finds `n` contiguous clear bits in [`start`, `end`).
+ * Full words are skipped as a whole, and so are
+ * completely clear ones.
+ *
+ * Returns the first bit of the run, or
+ * BITMAP_NONE if there is no such run.
+ */
+static inline size_t
+bitmap_find_zero_run(bitmap_t bitmap, size_t start, size_t end, size_t n)
+{
+    size_t run, run_start, base;
+    uint64_t word;
+
+    if (n == 1) {
+        return bitmap_find_first_zero(bitmap, start, end);
+    }
+
+    run = 0;
+    run_start = 0;
+
+    for (size_t w = start / BITMAP_WORD_BITS;
+         w * BITMAP_WORD_BITS < end; ++w) {
+        word = bitmap_fetch_word(bitmap, w, start, end);
+        base = w * BITMAP_WORD_BITS;
+
+        if (word == BITMAP_WORD_FULL) {
+            run = 0;
+            continue;
+        }
+
+        if (word == 0) {
+            if (run == 0) {
+                run_start = base;
+            }
+            run += BITMAP_WORD_BITS;
+            if (run >= n) {
+                return run_start;
+            }
+            continue;
+        }
+
+        for (size_t bit = 0; bit < BITMAP_WORD_BITS; ++bit) {
+            if (__TEST(word, __BIT(bit))) {
+                run = 0;
+                continue;
+            }
+            if (run == 0) {
+                run_start = base + bit;
+            }
+            if (++run >= n) {
+                return run_start;
+            }
+        }
+    }
+
+    return BITMAP_NONE;
+}
+
+/*
+ * Counts the set bits of a word. Done by hand as
+ * __builtin_popcountll() ends up in libgcc unless
+ * the CPU is known to have POPCNT.
+ */
+static inline size_t
+bitmap_word_popcount(uint64_t word)
+{
+    word -= (word >> 1) & 0x5555555555555555ULL;
+    word = (word & 0x3333333333333333ULL) +
+           ((word >> 2) & 0x3333333333333333ULL);
+    word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (word * 0x0101010101010101ULL) >> 56;
+}
+
+/*
+ * Returns the number of set bits
+ * in the first `nbits` bits.
+ */
+static inline size_t
+bitmap_popcount(bitmap_t bitmap, size_t nbits)
+{
+    const uint64_t *words = (uint64_t *)bitmap;
+    size_t count, nwords;
+    uint64_t mask;
+
+    count = 0;
+    nwords = nbits / BITMAP_WORD_BITS;
+
+    for (size_t w = 0; w < nwords; ++w) {
+        count += bitmap_word_popcount(words[w]);
+    }
+    if (nbits % BITMAP_WORD_BITS != 0) {
+        mask = bitmap_word_mask(0, nbits % BITMAP_WORD_BITS);
+        count += bitmap_word_popcount(words[nwords] & mask);
+    }
+
+    return count;
+}
+
 #endif      /* !_LIB_BITMAP_H_ */
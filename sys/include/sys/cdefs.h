@@ -38,6 +38,7 @@
 #define __attr(x)   __attribute__((x))
 #define __used      __attr(used)
 #define __weak      __attr(weak)
+#define __dead      __attr(noreturn)
 #define __used      __attr(used)
 
 /* __BIT(n): Set nth bit, where __BIT(0) == 0x1 */
@@ -34,4 +34,7 @@
 
 #define EXIT_FAILURE -1
 
+#define ENOMEM  12      /* Out of memory (or address space) */
+#define EINVAL  22      /* Invalid argument */
+
 #endif
@@ -66,14 +66,24 @@ struct processor_machdep {
             }
 #endif      /* defined(__x86_64__) */
 
+/* Max number of processors we can handle */
+#define MAXCPUS 32
+
 struct processor {
+    struct processor *self;             /* Points to itself */
+    uint32_t id;                        /* Logical ID, 0 is the BSP */
     struct processor_machdep machdep;
 };
 
 __weak void processor_init(struct processor *processor);
 __weak void interrupts_init(struct processor *processor);
+__weak bool processor_send_ipi(uint32_t cpus, uint8_t vector);
 
 void processor_halt(void);
+struct processor *this_processor(void);
+size_t processor_pagetables(uintptr_t *frames, size_t max);
+size_t processor_cache_colors(void);
+__dead void processor_stack_switch(uintptr_t sp, void(*func)(void));
 
 #endif  /* defined(_KERNEL) */
 #endif  /* !_SYS_MACHDEP_H_ */
@@ -38,10 +38,27 @@ struct spinlock {
     volatile _Atomic bool lock;
 };
 
+/*
+ * Tries to take `lock` once.
+ *
+ * Returns true if we now hold it.
+ */
 static inline bool
+spinlock_try_acquire(struct spinlock *lock)
+{
+    return !__atomic_test_and_set(&lock->lock, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Spins until `lock` is ours, only
+ * reading it while someone else has it.
+ */
+static inline void
 spinlock_acquire(struct spinlock *lock)
 {
-    return __atomic_test_and_set(&lock->lock, __ATOMIC_ACQUIRE);
+    while (!spinlock_try_acquire(lock)) {
+        while (__atomic_load_n(&lock->lock, __ATOMIC_RELAXED));
+    }
 }
 
 static inline void
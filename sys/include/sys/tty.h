@@ -48,6 +48,19 @@
 /* Default TTY tab width */
 #define DEFAULT_TAB_WIDTH   4
 
+/* Damaged areas tracked before they're merged into one */
+#define TTY_DAMAGE_MAX      8
+
+/* Most rows a TTY's cell grid tracks damage for */
+#define TTY_MAX_ROWS        512
+
+/* Output kept from before a TTY has cells, replayed into them */
+#define TTY_BOOTLOG_SIZE    4096
+
+/* Glyphs a TTY keeps expanded, and buckets to find them by */
+#define TTY_GLYPH_CACHE     128
+#define TTY_GLYPH_HASH      64
+
 /*
  * Describes the size
  * of a TTY window.
@@ -67,6 +80,28 @@ struct tty_ring {
     size_t len;
 };
 
+/*
+ * An area of the backbuffer, in pixels.
+ */
+struct tty_rect {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+};
+
+/*
+ * A character cell, what the TTY shows at
+ * one row and column.
+ */
+struct tty_cell {
+    char ch;
+    uint32_t fg;
+    uint32_t bg;
+};
+
+struct tty_glyph_cache;
+
 /*
  * Describes a TTY. Each TTY
  * shall be described by a
@@ -80,7 +115,18 @@ struct tty {
     uint32_t fg;                    /* Foreground (hex color) */
     uint32_t bg;                    /* Background (hex color) */
     uint8_t tab_width;              /* Width of a tab (in chars) */
-    struct fbdev fbdev;             /* Framebuffer device */
+    struct fbdev fbdev;             /* Framebuffer device (or backbuffer) */
+    struct fbdev front;             /* Framebuffer, if `fbdev` is a backbuffer */
+    struct tty_rect damage[TTY_DAMAGE_MAX]; /* Not copied to `front` yet */
+    uint8_t ndamage;
+    bool backbuffer;                /* Drawing into a backbuffer */
+    struct tty_cell *cells;         /* Rows x cols grid, ring of rows */
+    uint32_t head;                  /* Row of `cells` at the top */
+    uint64_t dirty[TTY_MAX_ROWS / 64]; /* Screen rows to repaint */
+    uint32_t scroll;                /* Rows to move the pixels up by */
+    char bootlog[TTY_BOOTLOG_SIZE]; /* Output before `cells` existed */
+    struct tty_glyph_cache *glyphs; /* Expanded glyphs, if any */
+    size_t bootlog_len;
     struct termios termios;         /* Termios state */
     struct winsize winsize;         /* Window size */
     struct tty_ring ring;          /* Ring buffer */
@@ -118,6 +164,11 @@ void tty_flush(struct tty *tty);
 ssize_t tty_write(struct tty *tty, const char *buf, size_t len);
 void tty_set_defaults(struct tty *tty);
 void tty_attach(struct tty *tty);
+void tty_backbuffer_init(void);
 void tty_init(void);
 
+#if defined(TTY_BENCH)
+void tty_bench(const char *label);
+#endif      /* defined(TTY_BENCH) */
+
 #endif  /* !_SYS_TTY_H_ */
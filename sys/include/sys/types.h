@@ -67,5 +67,7 @@ typedef int32_t     ssize_t;        /* Byte count or error */
 typedef _Bool bool;
 typedef ssize_t off_t;
 typedef size_t uintptr_t;
+typedef uintptr_t vaddr_t;        /* Virtual address */
+typedef uintptr_t paddr_t;        /* Physical address */
 
 #endif      /* !_SYS_TYPES_H_ */
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2023 Ian Marco Moffett and the VegaOS team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of VegaOS nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef _SYS_VMEM_H_
+#define _SYS_VMEM_H_
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/spinlock.h>
+
+typedef uintptr_t vmem_addr_t;
+typedef size_t vmem_size_t;
+
+/* Max length of an arena name, including the NUL */
+#define VMEM_NAMELEN        32
+
+/* One free list per power of two */
+#define VMEM_NFREELIST      64
+
+/* Buckets of allocated segments */
+#define VMEM_HASH_SIZE      128
+
+/* Quantum caches: most sizes (in quanta) and ranges each holds */
+#define VMEM_QCACHE_MAX     16
+#define VMEM_QCACHE_DEPTH   16
+
+/* vmem_alloc() flags */
+#define VMEM_INSTANTFIT     0x0     /* Take the first segment sure to fit */
+#define VMEM_BESTFIT        0x1     /* Take the smallest segment that fits */
+
+/* vmem_size() types */
+#define VMEM_ALLOC          0x1
+#define VMEM_FREE           0x2
+
+struct vmem_btag;
+TAILQ_HEAD(vmem_btaglist, vmem_btag);
+
+/*
+ * Cached ranges of a single size, handed
+ * out without touching the boundary tags.
+ */
+struct vmem_qcache {
+    size_t count;
+    vmem_addr_t addrs[VMEM_QCACHE_DEPTH];
+};
+
+/*
+ * A resource arena, managing ranges of integers
+ * (kernel virtual addresses, vectors, IDs, ...) in
+ * multiples of `quantum`.
+ */
+struct vmem {
+    char name[VMEM_NAMELEN];
+    vmem_size_t quantum;
+    size_t nqcache;                         /* Quantum caches in use */
+    vmem_size_t size;                       /* Sum of all spans */
+    vmem_size_t inuse;                      /* Allocated from spans */
+    struct spinlock lock;
+    struct vmem_btaglist seglist;           /* Every segment, by address */
+    struct vmem_btaglist freelist[VMEM_NFREELIST];
+    struct vmem_btaglist hash[VMEM_HASH_SIZE];
+    struct vmem_qcache qcache[VMEM_QCACHE_MAX];
+};
+
+int vmem_init(struct vmem *vm, const char *name, vmem_addr_t base,
+              vmem_size_t size, vmem_size_t quantum, vmem_size_t qcache_max);
+struct vmem *vmem_create(const char *name, vmem_addr_t base, vmem_size_t size,
+                         vmem_size_t quantum, vmem_size_t qcache_max);
+int vmem_add(struct vmem *vm, vmem_addr_t addr, vmem_size_t size);
+int vmem_alloc(struct vmem *vm, vmem_size_t size, int flags,
+               vmem_addr_t *addrp);
+void vmem_free(struct vmem *vm, vmem_addr_t addr, vmem_size_t size);
+vmem_size_t vmem_size(struct vmem *vm, int type);
+
+#endif      /* !_SYS_VMEM_H_ */
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2023 Ian Marco Moffett and the VegaOS team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of VegaOS nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef _VM_PMAP_H_
+#define _VM_PMAP_H_
+
+#include <sys/types.h>
+#include <sys/cdefs.h>
+#include <machine/pmap.h>
+
+/*
+ * pmap_enter() and pmap_remove() may defer TLB
+ * invalidation, call pmap_update() before relying
+ * on the old translations being gone.
+ */
+
+/* pmap_enter() protection */
+#define PMAP_WRITABLE   __BIT(0)
+#define PMAP_EXEC       __BIT(1)
+#define PMAP_USER       __BIT(2)
+#define PMAP_WC         __BIT(3)        /* Write-combining, for framebuffers */
+
+void pmap_init(void);
+struct pmap *pmap_kernel(void);
+
+int pmap_create(struct pmap *pmap);
+void pmap_destroy(struct pmap *pmap);
+void pmap_activate(struct pmap *pmap);
+void pmap_update(struct pmap *pmap);
+
+int pmap_enter(struct pmap *pmap, vaddr_t va, paddr_t pa, int prot);
+void pmap_remove(struct pmap *pmap, vaddr_t va);
+bool pmap_extract(struct pmap *pmap, vaddr_t va, paddr_t *pa);
+int pmap_direct_wc(paddr_t pa, size_t size);
+
+#endif      /* !_VM_PMAP_H_ */
@@ -34,12 +34,28 @@
 
 #include <sys/types.h>
 #include <sys/limine.h>
+#include <sys/vmem.h>
 
 extern volatile struct limine_hhdm_request g_hhdm_request;
+extern struct vmem g_kva_arena;
+
+#define PAGE_SIZE 0x1000
 
 #define VM_HIGHER_HALF (g_hhdm_request.response->offset)
 
-#define PHYS_TO_VIRT(phys) (void *)(phys + VM_HIGHER_HALF)
-#define VIRT_TO_PHYS(virt) ((uintptr_t)virt - VM_HIGHER_HALF)
+#define PHYS_TO_VIRT(phys) ((void *)((phys) + VM_HIGHER_HALF))
+#define VIRT_TO_PHYS(virt) ((uintptr_t)(virt) - VM_HIGHER_HALF)
+
+/*
+ * Kernel virtual addresses handed out by `g_kva_arena`,
+ * the last top level entry up to the kernel image.
+ */
+#define VM_KVA_BASE 0xFFFFFF8000000000
+#define VM_KVA_SIZE 0x7F80000000
+
+/* Ranges up to this size are served by quantum caches */
+#define VM_KVA_QCACHE_MAX (8 * PAGE_SIZE)
+
+void vm_kva_init(void);
 
 #endif      /* !_SYS_VM_VM_H_ */
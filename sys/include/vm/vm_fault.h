@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2023 Ian Marco Moffett and the VegaOS team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of VegaOS nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef _VM_VM_FAULT_H_
+#define _VM_VM_FAULT_H_
+
+#include <sys/types.h>
+#include <sys/cdefs.h>
+
+/* vm_fault() access */
+#define VM_FAULT_WRITE      __BIT(0)    /* Faulting access was a write */
+#define VM_FAULT_EXEC       __BIT(1)    /* Instruction fetch */
+#define VM_FAULT_USER       __BIT(2)    /* Came from user mode */
+#define VM_FAULT_PROT       __BIT(3)    /* Page was present, access denied */
+
+struct vm_fault_stats {
+    size_t minor;           /* Faults resolved by mapping a frame */
+    size_t invalid;         /* Faults that could not be resolved */
+    uint64_t cycles;        /* Total cycles spent resolving */
+    uint64_t max_cycles;    /* Slowest resolved fault */
+};
+
+int vm_fault(vaddr_t va, int access);
+void vm_fault_stats(struct vm_fault_stats *res);
+
+void *vm_lazy_alloc(size_t size);
+void vm_lazy_free(void *ptr);
+
+#endif      /* !_VM_VM_FAULT_H_ */
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2023 Ian Marco Moffett and the VegaOS team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of VegaOS nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef _VM_VM_PAGE_H_
+#define _VM_VM_PAGE_H_
+
+#include <sys/types.h>
+#include <sys/cdefs.h>
+#include <sys/queue.h>
+
+/* vm_page flags */
+#define VM_PAGE_WIRED   __BIT(0)    /* Pinned in place (e.g., for DMA) */
+#define VM_PAGE_ZERO    __BIT(1)    /* Zero filled, sitting in the zero pool */
+#define VM_PAGE_BOOT    __BIT(2)    /* Bootloader/ACPI memory not reclaimed yet */
+#define VM_PAGE_SLAB    __BIT(3)    /* Backs a slab, `slab` is valid */
+#define VM_PAGE_LARGE   __BIT(4)    /* Heads a large kmalloc(), `npages` is valid */
+#define VM_PAGE_COLORQ  __BIT(5)    /* Free, sitting on a color queue */
+
+/*
+ * Describes a single page frame, there is one
+ * for every frame within the physical segments.
+ *
+ * Kept at 32 bytes so two share a cacheline.
+ *
+ * `refcnt` is 0 while the frame is free, set to 1
+ * when it is allocated and only changed atomically
+ * past that. `flags` belong to the owner of the frame.
+ */
+struct vm_slab;
+
+struct vm_page {
+    union {
+        TAILQ_ENTRY(vm_page) pageq; /* Link for whatever page queue it's on */
+        struct vm_slab *slab;       /* VM_PAGE_SLAB: Slab it belongs to */
+        size_t npages;              /* VM_PAGE_LARGE: Pages allocated */
+    };
+    uintptr_t phys;                 /* Physical address of the frame */
+    uint32_t refcnt;                /* References held on the frame */
+    uint16_t flags;                 /* VM_PAGE_* */
+};
+
+_Static_assert(sizeof(struct vm_page) == 32, "struct vm_page must be 32 bytes");
+
+TAILQ_HEAD(vm_pageq, vm_page);
+
+/*
+ * Takes another reference on a frame
+ * that is already allocated.
+ */
+static inline void
+vm_page_ref(struct vm_page *pg)
+{
+    __atomic_add_fetch(&pg->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+struct vm_page *vm_page_lookup(uintptr_t phys);
+void vm_page_unref(struct vm_page *pg);
+
+#endif      /* !_VM_VM_PAGE_H_ */
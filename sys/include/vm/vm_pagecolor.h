@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2023 Ian Marco Moffett and the VegaOS team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of VegaOS nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef _VM_VM_PAGECOLOR_H_
+#define _VM_VM_PAGECOLOR_H_
+
+#include <sys/types.h>
+#include <sys/cdefs.h>
+
+/* Most page colors tracked, more are folded into these */
+#define VM_NCOLORS_MAX      256
+
+/* Free frames kept on each color queue at most */
+#define VM_PAGECOLOR_DEPTH  32
+
+/* Single frames taken at once when no run is left */
+#define VM_PAGECOLOR_BATCH  32
+
+/*
+ * A set of page colors, callers confining a subsystem
+ * to part of the LLC give it a set of its own.
+ */
+struct vm_colorset {
+    uint64_t bits[VM_NCOLORS_MAX / 64];
+};
+
+static inline void
+vm_colorset_add(struct vm_colorset *set, size_t color)
+{
+    set->bits[color / 64] |= __BIT(color % 64);
+}
+
+static inline bool
+vm_colorset_has(const struct vm_colorset *set, size_t color)
+{
+    return __TEST(set->bits[color / 64], __BIT(color % 64));
+}
+
+void vm_pagecolor_init(void);
+size_t vm_page_ncolors(void);
+size_t vm_page_color(uintptr_t phys);
+
+uintptr_t vm_alloc_colored(const struct vm_colorset *set, int flags);
+void vm_free_colored(uintptr_t phys);
+size_t vm_pagecolor_drain(void);
+
+#endif      /* !_VM_VM_PAGECOLOR_H_ */
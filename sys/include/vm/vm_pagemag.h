@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2023 Ian Marco Moffett and the VegaOS team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of VegaOS nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef _VM_VM_PAGEMAG_H_
+#define _VM_VM_PAGEMAG_H_
+
+#include <sys/types.h>
+
+/* Frames a magazine can hold */
+#define VM_PAGEMAG_SIZE     128
+
+/* Default watermarks */
+#define VM_PAGEMAG_LOW      32
+#define VM_PAGEMAG_HIGH     96
+
+struct vm_pagemag_stats {
+    size_t count;           /* Frames currently cached */
+    size_t hits;            /* Allocations served by the magazine */
+    size_t misses;          /* Allocations that had to refill */
+};
+
+uintptr_t vm_pagemag_alloc(void);
+void vm_pagemag_free(uintptr_t phys);
+size_t vm_pagemag_drain(void);
+void vm_pagemag_set_watermarks(size_t low, size_t high);
+void vm_pagemag_stats(uint32_t cpu, struct vm_pagemag_stats *res);
+
+#endif      /* !_VM_VM_PAGEMAG_H_ */
@@ -32,6 +32,30 @@
 #ifndef _VM_VM_PHYSSEG_H_
 #define _VM_VM_PHYSSEG_H_
 
+#include <sys/types.h>
+#include <sys/cdefs.h>
+
+/*
+ * Highest order handed out by the buddy
+ * allocator: 2^9 frames => 2 MiB blocks.
+ */
+#define VM_BUDDY_MAX_ORDER  9
+
+/* vm_alloc_pageframe() flags */
+#define VM_ALLOC_ZERO       __BIT(0)    /* Frames are returned zeroed */
+#define VM_ALLOC_NODRAIN    __BIT(1)    /* Fail instead of draining color queues */
+
 void vm_physseg_init(void);
+void vm_physseg_reclaim(void);
+paddr_t vm_physseg_top(void);
+uintptr_t vm_alloc_pageframe(size_t count, int flags);
+void vm_free_pageframe(uintptr_t phys, size_t count);
+
+size_t vm_physseg_alloc_batch(uintptr_t *frames, size_t count);
+void vm_physseg_free_batch(const uintptr_t *frames, size_t count);
+
+#if defined(VM_PHYSSEG_SELFTEST)
+void vm_physseg_selftest(void);
+#endif      /* defined(VM_PHYSSEG_SELFTEST) */
 
 #endif      /* !_VM_VM_PHYSSEG_H_ */
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2023 Ian Marco Moffett and the VegaOS team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of VegaOS nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef _VM_VM_SLAB_H_
+#define _VM_VM_SLAB_H_
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/spinlock.h>
+#include <sys/machdep.h>
+
+/* Max length of a cache name, including the NUL */
+#define VM_SLAB_NAMELEN     32
+
+/* Largest slab is 2^3 pages */
+#define VM_SLAB_MAX_ORDER   3
+
+/* kmalloc() sizes above this are page backed */
+#define VM_KMALLOC_MAX      2048
+
+/* Magazine rounds: starting size, most a magazine holds */
+#define VM_SLAB_MAG_MIN     8
+#define VM_SLAB_MAG_MAX     64
+
+/* Contended depot accesses before magazines grow */
+#define VM_SLAB_MAG_CONTENTION  16
+
+/* Full magazines a depot holds, past that they go back to the slabs */
+#define VM_SLAB_DEPOT_MAX   8
+
+struct vm_slab;
+
+/*
+ * A magazine: a stack of up to `magsize`
+ * (of the cache) constructed objects.
+ */
+struct vm_slab_mag {
+    TAILQ_ENTRY(vm_slab_mag) link;
+    size_t rounds;
+    void *objs[VM_SLAB_MAG_MAX];
+} __cacheline_aligned;
+
+/*
+ * Per-processor magazines of a cache, only ever
+ * touched by their own processor. `loaded` is used
+ * first, `prev` is swapped in when `loaded` runs
+ * out (or over).
+ */
+struct vm_slab_cpu {
+    struct vm_slab_mag *loaded;
+    struct vm_slab_mag *prev;
+} __cacheline_aligned;
+
+/*
+ * A cache of objects of a single size. Objects are
+ * carved out of slabs, kept on one of three lists
+ * depending on how many of their objects are free.
+ *
+ * Objects go through `ctor` once, when their slab
+ * is made, and must be freed in that state.
+ */
+struct vm_slab_cache {
+    char name[VM_SLAB_NAMELEN];
+    size_t objsize;             /* Object size, `align` aligned */
+    size_t reqsize;             /* Object size asked for */
+    size_t align;               /* Object alignment */
+    int order;                  /* Slabs are 2^order pages */
+    size_t nobjs;               /* Objects per slab */
+    size_t hdrsize;             /* Slab header size, before coloring */
+    size_t ncolors;             /* Distinct first object offsets */
+    size_t color_next;          /* Color of the next slab made */
+    void(*ctor)(void *obj);
+    TAILQ_HEAD(, vm_slab) full;
+    TAILQ_HEAD(, vm_slab) partial;
+    TAILQ_HEAD(, vm_slab) empty;
+    size_t nslabs;
+    size_t nactive;             /* Objects out of slabs (magazines included) */
+    struct spinlock lock;
+    TAILQ_ENTRY(vm_slab_cache) link;
+
+    /* Magazine layer, not used if `magsize` is 0 */
+    size_t magsize;             /* Rounds per magazine */
+    size_t contention;          /* Contended depot accesses since resize */
+    TAILQ_HEAD(, vm_slab_mag) depot_full;
+    size_t depot_nfull;
+    TAILQ_HEAD(, vm_slab_mag) depot_empty;
+    struct spinlock depot_lock;
+    struct vm_slab_cpu cpu[MAXCPUS];
+};
+
+struct vm_slab_stats {
+    size_t active;              /* Objects handed out */
+    size_t total;               /* Objects within all slabs */
+    size_t slabs;               /* Slabs in the cache */
+    size_t waste;               /* Bytes within slabs not holding requested data */
+    size_t magsize;             /* Rounds per magazine */
+};
+
+void vm_slab_init(void);
+struct vm_slab_cache *vm_slab_cache_create(const char *name, size_t size,
+                                           size_t align,
+                                           void(*ctor)(void *obj));
+void *vm_slab_alloc(struct vm_slab_cache *cache);
+void vm_slab_free(struct vm_slab_cache *cache, void *obj);
+void vm_slab_stats(struct vm_slab_cache *cache, struct vm_slab_stats *res);
+
+void *kmalloc(size_t size);
+void kfree(void *ptr);
+
+#endif      /* !_VM_VM_SLAB_H_ */
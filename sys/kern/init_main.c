@@ -33,20 +33,54 @@
 #include <sys/tty.h>
 #include <sys/syslog.h>
 #include <sys/machdep.h>
+#include <sys/panic.h>
 #include <firmware/acpi/acpi.h>
 #include <vm/vm_physseg.h>
+#include <vm/vm_zeropool.h>
+#include <vm/vm_pagecolor.h>
+#include <vm/pmap.h>
+#include <vm/vm_slab.h>
+#include <vm/vm.h>
 #include <logo.h>
 
 __KERNEL_META("$Vega$: init_main.c, Ian Marco Moffett, "
               "Where the Vega kernel first starts up");
 
+/*
+ * Size of the stack main() moves to once
+ * done with the bootloader's (in pages).
+ */
+#define MAIN_STACK_PAGES 4
+
 static struct processor bsp = {
     .machdep = DEFAULT_PROCESSOR_MACHDEP
 };
 
+/*
+ * Runs on a kernel owned stack, nothing
+ * bootloader provided is needed past here.
+ */
+__dead static void
+main_late(void)
+{
+    vm_physseg_reclaim();
+
+    for (;;) {
+        /* Spend idle time zeroing frames ahead of time */
+        if (vm_zeropool_work() > 0) {
+            continue;
+        }
+
+        /* We're done here, halt the processor */
+        __ASMV("cli; hlt");
+    }
+}
+
 void
 main(void)
 {
+    uintptr_t stack;
+
     tty_init();
     syslog_init();
     PRINT_LOGO();
@@ -57,9 +91,36 @@ main(void)
 
     processor_init(&bsp);
     vm_physseg_init();
+#if defined(VM_PHYSSEG_SELFTEST)
+    vm_physseg_selftest();
+#endif      /* defined(VM_PHYSSEG_SELFTEST) */
+    vm_pagecolor_init();
+    pmap_init();
+    vm_slab_init();
+    vm_kva_init();
+
+#if defined(TTY_BENCH)
+    tty_bench("boot mapping");
+#endif      /* defined(TTY_BENCH) */
+
+    /* Now the framebuffer can be made write-combining */
+    fbdev_init();
+#if defined(TTY_BENCH)
+    tty_bench("write-combining");
+#endif      /* defined(TTY_BENCH) */
+    tty_backbuffer_init();
+#if defined(TTY_BENCH)
+    tty_bench("backbuffer");
+#endif      /* defined(TTY_BENCH) */
 
     acpi_init();
 
-    /* We're done here, halt the processor */
-    __ASMV("cli; hlt");
+    /* The boot stack is bootloader reclaimable, move off of it */
+    stack = vm_alloc_pageframe(MAIN_STACK_PAGES, 0);
+    if (stack == 0) {
+        panic("Could not allocate a stack for main()\n");
+    }
+
+    stack = (uintptr_t)PHYS_TO_VIRT(stack) + MAIN_STACK_PAGES*PAGE_SIZE;
+    processor_stack_switch(stack, main_late);
 }
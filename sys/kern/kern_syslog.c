@@ -33,10 +33,42 @@
 #include <sys/tty.h>
 #include <string.h>
 
+/* Bytes of kprintf() output gathered before they're written */
+#define SYSLOG_BUFSIZE 256
+
+/*
+ * Output of a single kprintf(), handed to the
+ * TTY in one write so it is drawn in one go.
+ */
+struct syslog_buf {
+    char data[SYSLOG_BUFSIZE];
+    size_t len;
+};
+
 static struct tty syslog_tty;
 
 static void
-syslog_handle_fmt(va_list *ap, char fmt_spec)
+syslog_flush(struct syslog_buf *buf)
+{
+    if (buf->len > 0) {
+        tty_write(&syslog_tty, buf->data, buf->len);
+        buf->len = 0;
+    }
+}
+
+static void
+syslog_put(struct syslog_buf *buf, const char *str, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        if (buf->len == SYSLOG_BUFSIZE) {
+            syslog_flush(buf);
+        }
+        buf->data[buf->len++] = str[i];
+    }
+}
+
+static void
+syslog_handle_fmt(struct syslog_buf *buf, va_list *ap, char fmt_spec)
 {
     char tmp_ch;
     int64_t tmp_int;
@@ -46,21 +78,21 @@ syslog_handle_fmt(va_list *ap, char fmt_spec)
     switch (fmt_spec) {
     case 'c':
         tmp_ch = va_arg(*ap, int);
-        tty_write(&syslog_tty, &tmp_ch, 1);
+        syslog_put(buf, &tmp_ch, 1);
         break;
     case 's':
         tmp_str = va_arg(*ap, const char *);
-        tty_write(&syslog_tty, tmp_str, strlen(tmp_str));
+        syslog_put(buf, tmp_str, strlen(tmp_str));
         break;
     case 'd':
         tmp_int = va_arg(*ap, int64_t);
         itoa(tmp_int, tmp_buf, 10);
-        tty_write(&syslog_tty, tmp_buf, strlen(tmp_buf));
+        syslog_put(buf, tmp_buf, strlen(tmp_buf));
         break;
     case 'x':
         tmp_int = va_arg(*ap, uint64_t);
         itoa(tmp_int, tmp_buf, 16);
-        tty_write(&syslog_tty, tmp_buf + 2, strlen(tmp_buf) - 2);
+        syslog_put(buf, tmp_buf + 2, strlen(tmp_buf) - 2);
         break;
     }
 }
@@ -68,14 +100,19 @@ syslog_handle_fmt(va_list *ap, char fmt_spec)
 void
 vkprintf(const char *fmt, va_list *ap)
 {
+    struct syslog_buf buf;
+
+    buf.len = 0;
     while (*fmt) {
         if (*fmt == '%') {
             ++fmt;
-            syslog_handle_fmt(ap, *fmt++);
+            syslog_handle_fmt(&buf, ap, *fmt++);
         } else {
-            tty_write(&syslog_tty, fmt++, 1);
+            syslog_put(&buf, fmt++, 1);
         }
     }
+
+    syslog_flush(&buf);
 }
 
 void
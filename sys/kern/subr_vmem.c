@@ -0,0 +1,505 @@
+/*
+ * Copyright (c) 2023 Ian Marco Moffett and the VegaOS team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of VegaOS nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#include <sys/cdefs.h>
+#include <sys/vmem.h>
+#include <sys/errno.h>
+#include <sys/syslog.h>
+#include <vm/vm_slab.h>
+
+__MODULE_NAME("subr_vmem");
+__KERNEL_META("$Vega$: subr_vmem.c, Ian Marco Moffett, "
+              "Resource arena allocator");
+
+#if defined(VMEM_DEBUG)
+#define DPRINTF(...) KDEBUG(__VA_ARGS__)
+#else
+#define DPRINTF(...) __nothing
+#endif      /* defined(VMEM_DEBUG) */
+
+#define BT_SPAN     0       /* Start of a range given to vmem_add() */
+#define BT_FREE     1
+#define BT_ALLOC    2
+
+/*
+ * Boundary tag, describes a segment of an arena.
+ *
+ * Every tag sits on `seglist` in address order, a
+ * span tag in front of the segments it covers. Free
+ * segments also sit on the free list for their size,
+ * allocated ones on a hash chain for vmem_free().
+ */
+struct vmem_btag {
+    TAILQ_ENTRY(vmem_btag) seglist;
+    TAILQ_ENTRY(vmem_btag) list;        /* Free list or hash chain */
+    vmem_addr_t start;
+    vmem_size_t size;
+    int type;
+};
+
+static struct vm_slab_cache *btag_cache = NULL;
+
+static inline int
+vmem_log2(vmem_size_t size)
+{
+    return 63 - __builtin_clzll(size);
+}
+
+static inline struct vmem_btaglist *
+vmem_hash_bucket(struct vmem *vm, vmem_addr_t addr)
+{
+    return &vm->hash[(addr / vm->quantum) % VMEM_HASH_SIZE];
+}
+
+static struct vmem_btag *
+vmem_btag_alloc(void)
+{
+    if (btag_cache == NULL) {
+        btag_cache = vm_slab_cache_create("vmem_btag",
+                                          sizeof(struct vmem_btag), 0, NULL);
+        if (btag_cache == NULL) {
+            return NULL;
+        }
+    }
+
+    return vm_slab_alloc(btag_cache);
+}
+
+static inline void
+vmem_btag_free(struct vmem_btag *bt)
+{
+    vm_slab_free(btag_cache, bt);
+}
+
+/*
+ * Free lists are by power of two, list n holding
+ * segments of 2^n up to 2^(n + 1) - 1.
+ */
+static inline void
+vmem_freelist_insert(struct vmem *vm, struct vmem_btag *bt)
+{
+    bt->type = BT_FREE;
+    TAILQ_INSERT_HEAD(&vm->freelist[vmem_log2(bt->size)], bt, list);
+}
+
+static inline void
+vmem_freelist_remove(struct vmem *vm, struct vmem_btag *bt)
+{
+    TAILQ_REMOVE(&vm->freelist[vmem_log2(bt->size)], bt, list);
+}
+
+/*
+ * Looks for a free segment of at least `size`.
+ *
+ * Instant fit starts at the first list whose segments
+ * all fit, taking whatever is there. Best fit starts
+ * at the list `size` falls in and takes the smallest
+ * segment that fits from the first list with one.
+ *
+ * => Call with the lock of `vm` held.
+ */
+static struct vmem_btag *
+vmem_find_free(struct vmem *vm, vmem_size_t size, int flags)
+{
+    struct vmem_btag *bt, *best;
+    int first;
+
+    first = vmem_log2(size);
+    if (flags == VMEM_INSTANTFIT && __POW2(first) != size) {
+        ++first;
+    }
+
+    for (int i = first; i < VMEM_NFREELIST; ++i) {
+        best = NULL;
+        TAILQ_FOREACH(bt, &vm->freelist[i], list) {
+            if (bt->size < size) {
+                continue;
+            }
+            if (flags == VMEM_INSTANTFIT) {
+                return bt;
+            }
+            if (best == NULL || bt->size < best->size) {
+                best = bt;
+            }
+        }
+
+        if (best != NULL) {
+            return best;
+        }
+    }
+
+    /* Instant fit skipped the list that may still have a fit */
+    if (flags == VMEM_INSTANTFIT && first > vmem_log2(size)) {
+        return vmem_find_free(vm, size, VMEM_BESTFIT);
+    }
+
+    return NULL;
+}
+
+/*
+ * Allocates `size` (quantum aligned) out
+ * of the segments of `vm`.
+ */
+static int
+vmem_alloc_seg(struct vmem *vm, vmem_size_t size, int flags,
+               vmem_addr_t *addrp)
+{
+    struct vmem_btag *bt, *rest;
+
+    /* Might have to split, so have a tag ready */
+    if ((rest = vmem_btag_alloc()) == NULL) {
+        return ENOMEM;
+    }
+
+    spinlock_acquire(&vm->lock);
+    if ((bt = vmem_find_free(vm, size, flags)) == NULL) {
+        spinlock_release(&vm->lock);
+        vmem_btag_free(rest);
+        return ENOMEM;
+    }
+
+    vmem_freelist_remove(vm, bt);
+    if (bt->size > size) {
+        rest->start = bt->start + size;
+        rest->size = bt->size - size;
+        TAILQ_INSERT_AFTER(&vm->seglist, bt, rest, seglist);
+        vmem_freelist_insert(vm, rest);
+        bt->size = size;
+        rest = NULL;
+    }
+
+    bt->type = BT_ALLOC;
+    TAILQ_INSERT_HEAD(vmem_hash_bucket(vm, bt->start), bt, list);
+    vm->inuse += size;
+    *addrp = bt->start;
+    spinlock_release(&vm->lock);
+
+    if (rest != NULL) {
+        vmem_btag_free(rest);
+    }
+
+    return 0;
+}
+
+/*
+ * Frees the segment at `addr`, coalescing
+ * it with free neighbours.
+ */
+static void
+vmem_free_seg(struct vmem *vm, vmem_addr_t addr)
+{
+    struct vmem_btaglist *bucket;
+    struct vmem_btag *bt, *prev, *next;
+    struct vmem_btag *dead[2] = { NULL, NULL };
+
+    spinlock_acquire(&vm->lock);
+    bucket = vmem_hash_bucket(vm, addr);
+    TAILQ_FOREACH(bt, bucket, list) {
+        if (bt->start == addr) {
+            break;
+        }
+    }
+
+    if (bt == NULL) {
+        spinlock_release(&vm->lock);
+        DPRINTF("%s: freeing unallocated 0x%x\n", vm->name, addr);
+        return;
+    }
+
+    TAILQ_REMOVE(bucket, bt, list);
+    vm->inuse -= bt->size;
+
+    /* Span tags keep segments of different spans apart */
+    next = TAILQ_NEXT(bt, seglist);
+    if (next != NULL && next->type == BT_FREE) {
+        vmem_freelist_remove(vm, next);
+        TAILQ_REMOVE(&vm->seglist, next, seglist);
+        bt->size += next->size;
+        dead[0] = next;
+    }
+
+    prev = TAILQ_PREV(bt, vmem_btaglist, seglist);
+    if (prev != NULL && prev->type == BT_FREE) {
+        vmem_freelist_remove(vm, prev);
+        TAILQ_REMOVE(&vm->seglist, bt, seglist);
+        prev->size += bt->size;
+        dead[1] = bt;
+        bt = prev;
+    }
+
+    vmem_freelist_insert(vm, bt);
+    spinlock_release(&vm->lock);
+
+    for (size_t i = 0; i < __ARRAY_COUNT(dead); ++i) {
+        if (dead[i] != NULL) {
+            vmem_btag_free(dead[i]);
+        }
+    }
+}
+
+/*
+ * Sets up an arena in `vm` handing out multiples
+ * of `quantum` (a power of two). Sizes up to
+ * `qcache_max` are served by quantum caches.
+ *
+ * `size` bytes from `base` are added right away
+ * unless `size` is 0.
+ *
+ * Returns 0 on success, otherwise an errno.
+ */
+int
+vmem_init(struct vmem *vm, const char *name, vmem_addr_t base,
+          vmem_size_t size, vmem_size_t quantum, vmem_size_t qcache_max)
+{
+    size_t i;
+
+    if (quantum == 0 || (quantum & (quantum - 1)) != 0) {
+        return EINVAL;
+    }
+
+    for (i = 0; i < VMEM_NAMELEN - 1 && name[i] != '\0'; ++i) {
+        vm->name[i] = name[i];
+    }
+    vm->name[i] = '\0';
+
+    vm->quantum = quantum;
+    vm->nqcache = __MIN(qcache_max / quantum, VMEM_QCACHE_MAX);
+    vm->size = 0;
+    vm->inuse = 0;
+    vm->lock = (struct spinlock) { 0 };
+
+    TAILQ_INIT(&vm->seglist);
+    for (i = 0; i < VMEM_NFREELIST; ++i) {
+        TAILQ_INIT(&vm->freelist[i]);
+    }
+    for (i = 0; i < VMEM_HASH_SIZE; ++i) {
+        TAILQ_INIT(&vm->hash[i]);
+    }
+    for (i = 0; i < VMEM_QCACHE_MAX; ++i) {
+        vm->qcache[i].count = 0;
+    }
+
+    if (size == 0) {
+        return 0;
+    }
+
+    return vmem_add(vm, base, size);
+}
+
+/*
+ * Like vmem_init(), but with the arena
+ * itself allocated by kmalloc().
+ *
+ * Returns NULL on failure.
+ */
+struct vmem *
+vmem_create(const char *name, vmem_addr_t base, vmem_size_t size,
+            vmem_size_t quantum, vmem_size_t qcache_max)
+{
+    struct vmem *vm;
+
+    if ((vm = kmalloc(sizeof(*vm))) == NULL) {
+        return NULL;
+    }
+
+    if (vmem_init(vm, name, base, size, quantum, qcache_max) != 0) {
+        kfree(vm);
+        return NULL;
+    }
+
+    return vm;
+}
+
+/*
+ * Adds the range of `size` from `addr` to `vm`,
+ * it must not overlap anything added before.
+ *
+ * Returns 0 on success, otherwise an errno.
+ */
+int
+vmem_add(struct vmem *vm, vmem_addr_t addr, vmem_size_t size)
+{
+    struct vmem_btag *span, *bt, *pos;
+
+    if (size == 0 || (addr | size) & (vm->quantum - 1)) {
+        return EINVAL;
+    }
+
+    if ((span = vmem_btag_alloc()) == NULL) {
+        return ENOMEM;
+    }
+    if ((bt = vmem_btag_alloc()) == NULL) {
+        vmem_btag_free(span);
+        return ENOMEM;
+    }
+
+    span->type = BT_SPAN;
+    span->start = addr;
+    span->size = size;
+    bt->start = addr;
+    bt->size = size;
+
+    spinlock_acquire(&vm->lock);
+
+    /* Keep `seglist` in address order */
+    TAILQ_FOREACH(pos, &vm->seglist, seglist) {
+        if (pos->type == BT_SPAN && pos->start > addr) {
+            break;
+        }
+    }
+
+    if (pos != NULL) {
+        TAILQ_INSERT_BEFORE(pos, span, seglist);
+    } else {
+        TAILQ_INSERT_TAIL(&vm->seglist, span, seglist);
+    }
+
+    TAILQ_INSERT_AFTER(&vm->seglist, span, bt, seglist);
+    vmem_freelist_insert(vm, bt);
+    vm->size += size;
+    spinlock_release(&vm->lock);
+
+    DPRINTF("%s: added 0x%x - 0x%x\n", vm->name, addr, addr + size);
+    return 0;
+}
+
+/*
+ * Allocates `size` out of `vm`, rounded up to the
+ * quantum. `flags` is VMEM_INSTANTFIT or VMEM_BESTFIT.
+ *
+ * Returns 0 and the start in `addrp` on success,
+ * otherwise an errno.
+ */
+int
+vmem_alloc(struct vmem *vm, vmem_size_t size, int flags, vmem_addr_t *addrp)
+{
+    struct vmem_qcache *qc;
+    vmem_addr_t addr;
+    size_t nquanta;
+    bool cached;
+    int error;
+
+    if (size == 0) {
+        return EINVAL;
+    }
+
+    size = __ALIGN_UP(size, vm->quantum);
+    nquanta = size / vm->quantum;
+    if (nquanta > vm->nqcache) {
+        return vmem_alloc_seg(vm, size, flags, addrp);
+    }
+
+    qc = &vm->qcache[nquanta - 1];
+    spinlock_acquire(&vm->lock);
+    if (qc->count > 0) {
+        *addrp = qc->addrs[--qc->count];
+        spinlock_release(&vm->lock);
+        return 0;
+    }
+    spinlock_release(&vm->lock);
+
+    /*
+     * Refill half the cache in one go so small
+     * allocations mostly skip the segment lists.
+     */
+    if ((error = vmem_alloc_seg(vm, size, flags, addrp)) != 0) {
+        return error;
+    }
+
+    for (size_t i = 1; i < VMEM_QCACHE_DEPTH / 2; ++i) {
+        if (vmem_alloc_seg(vm, size, flags, &addr) != 0) {
+            break;
+        }
+
+        spinlock_acquire(&vm->lock);
+        if ((cached = qc->count < VMEM_QCACHE_DEPTH)) {
+            qc->addrs[qc->count++] = addr;
+        }
+        spinlock_release(&vm->lock);
+
+        if (!cached) {
+            vmem_free_seg(vm, addr);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Frees `size` at `addr`, as allocated
+ * by vmem_alloc() from `vm`.
+ */
+void
+vmem_free(struct vmem *vm, vmem_addr_t addr, vmem_size_t size)
+{
+    struct vmem_qcache *qc;
+    size_t nquanta;
+
+    size = __ALIGN_UP(size, vm->quantum);
+    nquanta = size / vm->quantum;
+    if (nquanta == 0 || nquanta > vm->nqcache) {
+        vmem_free_seg(vm, addr);
+        return;
+    }
+
+    qc = &vm->qcache[nquanta - 1];
+    spinlock_acquire(&vm->lock);
+    if (qc->count < VMEM_QCACHE_DEPTH) {
+        qc->addrs[qc->count++] = addr;
+        spinlock_release(&vm->lock);
+        return;
+    }
+    spinlock_release(&vm->lock);
+
+    vmem_free_seg(vm, addr);
+}
+
+/*
+ * Returns how much of `vm` is allocated (VMEM_ALLOC),
+ * free (VMEM_FREE) or both. Ranges sitting in quantum
+ * caches count as allocated.
+ */
+vmem_size_t
+vmem_size(struct vmem *vm, int type)
+{
+    vmem_size_t size = 0;
+
+    spinlock_acquire(&vm->lock);
+    if (__TEST(type, VMEM_ALLOC)) {
+        size += vm->inuse;
+    }
+    if (__TEST(type, VMEM_FREE)) {
+        size += vm->size - vm->inuse;
+    }
+    spinlock_release(&vm->lock);
+
+    return size;
+}
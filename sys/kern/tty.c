@@ -33,6 +33,9 @@
 #include <sys/cdefs.h>
 #include <sys/errno.h>
 #include <sys/ascii.h>
+#include <sys/syslog.h>
+#include <machine/tsc.h>
+#include <vm/vm_vmalloc.h>
 #include <string.h>
 #include <tty_font.h>
 
@@ -48,39 +51,275 @@
 #define CURSOR_WIDTH            FONT_WIDTH
 #define CURSOR_HEIGHT           FONT_HEIGHT
 
+__MODULE_NAME("tty");
 __KERNEL_META("$Vega$: tty.c, Ian Marco Moffett, "
               "Core TTY implementation");
 
+#if defined(TTY_BENCH)
+/* Lines of kprintf() output timed by tty_bench() */
+#define TTY_BENCH_LINES 256
+
+/* Lines tty_bench() prints with a single kprintf() */
+#define TTY_BENCH_BLOCK 8
+
+/* Calls to tty_move_up() and rows moved, see tty_bench() */
+static size_t bench_moves = 0;
+static size_t bench_rows = 0;
+#endif      /* defined(TTY_BENCH) */
+
+/*
+ * A glyph expanded for one pair of colors, drawn with
+ * a straight copy of each row.
+ */
+struct tty_glyph_row {
+    uint32_t px[FONT_WIDTH];
+};
+
+struct tty_glyph {
+    TAILQ_ENTRY(tty_glyph) lru;
+    TAILQ_ENTRY(tty_glyph) hash;
+    uint8_t ch;
+    bool valid;
+    uint32_t fg;
+    uint32_t bg;
+    struct tty_glyph_row rows[FONT_HEIGHT];
+};
+
+/*
+ * Most recently used glyphs are at the
+ * head of `lru`, the tail gets evicted.
+ */
+struct tty_glyph_cache {
+    TAILQ_HEAD(tty_glyph_lru, tty_glyph) lru;
+    TAILQ_HEAD(, tty_glyph) hash[TTY_GLYPH_HASH];
+    struct tty_glyph glyphs[TTY_GLYPH_CACHE];
+};
+
 /* List of attached TTYs */
 static TAILQ_HEAD(, tty) tty_list;
 
 /*
- * Renders a char onto the
- * TTY specified by `tty`.
+ * Returns true if `a` and `b` overlap
+ * or share an edge.
+ */
+static inline bool
+tty_rect_touches(const struct tty_rect *a, const struct tty_rect *b)
+{
+    return a->x <= b->x + b->width && b->x <= a->x + a->width &&
+           a->y <= b->y + b->height && b->y <= a->y + a->height;
+}
+
+/*
+ * Grows `a` to also cover `b`.
+ */
+static inline void
+tty_rect_union(struct tty_rect *a, const struct tty_rect *b)
+{
+    uint32_t x2, y2;
+
+    x2 = __MAX(a->x + a->width, b->x + b->width);
+    y2 = __MAX(a->y + a->height, b->y + b->height);
+    a->x = __MIN(a->x, b->x);
+    a->y = __MIN(a->y, b->y);
+    a->width = x2 - a->x;
+    a->height = y2 - a->y;
+}
+
+/*
+ * Records an area of the backbuffer that has to
+ * be copied to the front buffer by tty_present().
+ *
+ * Call with TTY locked.
+ */
+static void
+tty_damage(struct tty *tty, uint32_t x, uint32_t y, uint32_t width,
+           uint32_t height)
+{
+    struct tty_rect rect = { x, y, width, height };
+
+    if (!tty->backbuffer) {
+        /* Already drawn onto the front buffer */
+        return;
+    }
+
+    for (uint8_t i = 0; i < tty->ndamage; ++i) {
+        if (tty_rect_touches(&tty->damage[i], &rect)) {
+            tty_rect_union(&tty->damage[i], &rect);
+            return;
+        }
+    }
+
+    if (tty->ndamage < TTY_DAMAGE_MAX) {
+        tty->damage[tty->ndamage++] = rect;
+        return;
+    }
+
+    /* Out of room, fold everything into one */
+    for (uint8_t i = 1; i < tty->ndamage; ++i) {
+        tty_rect_union(&tty->damage[0], &tty->damage[i]);
+    }
+    tty_rect_union(&tty->damage[0], &rect);
+    tty->ndamage = 1;
+}
+
+static inline size_t
+tty_glyph_hash(uint8_t ch, uint32_t fg, uint32_t bg)
+{
+    return (ch ^ (fg * 31) ^ (bg * 17)) % TTY_GLYPH_HASH;
+}
+
+/*
+ * Expands `ch` in `fg` on `bg` into `glyph`,
+ * bit 7 of each font row is the leftmost pixel.
+ */
+static void
+tty_glyph_expand(struct tty_glyph *glyph, uint8_t ch, uint32_t fg, uint32_t bg)
+{
+    const uint8_t *font;
+
+    font = &DEFAULT_FONT_DATA[ch * FONT_HEIGHT];
+    for (uint32_t cy = 0; cy < FONT_HEIGHT; ++cy) {
+        for (uint32_t cx = 0; cx < FONT_WIDTH; ++cx) {
+            glyph->rows[cy].px[FONT_WIDTH - 1 - cx] =
+                __TEST(font[cy], __BIT(cx)) ? fg : bg;
+        }
+    }
+
+    glyph->ch = ch;
+    glyph->fg = fg;
+    glyph->bg = bg;
+    glyph->valid = true;
+}
+
+/*
+ * Returns `ch` expanded for `fg` and `bg`, the least
+ * recently used glyph is evicted if it isn't cached.
+ */
+static const struct tty_glyph *
+tty_glyph_lookup(struct tty_glyph_cache *cache, uint8_t ch, uint32_t fg,
+                 uint32_t bg)
+{
+    struct tty_glyph *glyph;
+    size_t bucket;
+
+    bucket = tty_glyph_hash(ch, fg, bg);
+    TAILQ_FOREACH(glyph, &cache->hash[bucket], hash) {
+        if (glyph->ch == ch && glyph->fg == fg && glyph->bg == bg) {
+            break;
+        }
+    }
+
+    if (glyph == NULL) {
+        glyph = TAILQ_LAST(&cache->lru, tty_glyph_lru);
+        if (glyph->valid) {
+            TAILQ_REMOVE(&cache->hash[tty_glyph_hash(glyph->ch, glyph->fg,
+                         glyph->bg)], glyph, hash);
+        }
+
+        tty_glyph_expand(glyph, ch, fg, bg);
+        TAILQ_INSERT_HEAD(&cache->hash[bucket], glyph, hash);
+    }
+
+    if (glyph != TAILQ_FIRST(&cache->lru)) {
+        TAILQ_REMOVE(&cache->lru, glyph, lru);
+        TAILQ_INSERT_HEAD(&cache->lru, glyph, lru);
+    }
+
+    return glyph;
+}
+
+/*
+ * Sets up an empty glyph cache.
  */
 static void
-tty_draw_char(struct tty *tty, char c, uint32_t fg, uint32_t bg)
+tty_glyph_init(struct tty_glyph_cache *cache)
+{
+    TAILQ_INIT(&cache->lru);
+    for (size_t i = 0; i < TTY_GLYPH_HASH; ++i) {
+        TAILQ_INIT(&cache->hash[i]);
+    }
+
+    for (size_t i = 0; i < TTY_GLYPH_CACHE; ++i) {
+        cache->glyphs[i].valid = false;
+        TAILQ_INSERT_TAIL(&cache->lru, &cache->glyphs[i], lru);
+    }
+}
+
+/*
+ * Renders `c` with its top left
+ * corner at `x` and `y`.
+ */
+static void
+tty_draw_glyph(struct tty *tty, uint32_t x, uint32_t y, char c, uint32_t fg,
+               uint32_t bg)
 {
     uint32_t *fb_ptr;
-    uint32_t x, y;
     size_t idx;
-    const uint8_t *glyph;
+    const uint8_t *font;
+    const struct tty_glyph *glyph;
 
     /* Get a pointer to framebuffer memory */
     fb_ptr = tty->fbdev.mem;
 
-    /* Get the specific glyph of `c` */
-    glyph = &DEFAULT_FONT_DATA[(int)c*16];
+    if (tty->glyphs != NULL) {
+        glyph = tty_glyph_lookup(tty->glyphs, c, fg, bg);
+        idx = fbdev_get_index(&tty->fbdev, x, y);
+        for (uint32_t cy = 0; cy < FONT_HEIGHT; ++cy) {
+            memcpy32(&fb_ptr[idx], glyph->rows[cy].px, FONT_WIDTH);
+            idx += tty->fbdev.pitch / 4;
+        }
 
-    x = tty->chpos_x;
-    y = tty->chpos_y;
+        tty_damage(tty, x, y, FONT_WIDTH, FONT_HEIGHT);
+        return;
+    }
+
+    /* Get the specific glyph of `c` */
+    font = &DEFAULT_FONT_DATA[(uint8_t)c * FONT_HEIGHT];
 
     for (uint32_t cy = 0; cy < FONT_HEIGHT; ++cy) {
         for (uint32_t cx = 0; cx < FONT_WIDTH; ++cx) {
-            idx = fbdev_get_index(&tty->fbdev, x+FONT_WIDTH-cx, y+cy);
-            fb_ptr[idx] = __TEST(glyph[cy], __BIT(cx)) ? fg : bg;
+            idx = fbdev_get_index(&tty->fbdev, x+FONT_WIDTH-1-cx, y+cy);
+            fb_ptr[idx] = __TEST(font[cy], __BIT(cx)) ? fg : bg;
         }
     }
+
+    tty_damage(tty, x, y, FONT_WIDTH, FONT_HEIGHT);
+}
+
+/*
+ * Returns the cells of screen row `row`.
+ */
+static inline struct tty_cell *
+tty_cell_row(struct tty *tty, uint32_t row)
+{
+    return &tty->cells[((tty->head + row) % tty->t_ws_row) * tty->t_ws_col];
+}
+
+static inline void
+tty_mark_row(struct tty *tty, uint32_t row)
+{
+    if (row < TTY_MAX_ROWS) {
+        tty->dirty[row / 64] |= __BIT(row % 64);
+    }
+}
+
+static inline void
+tty_mark_all(struct tty *tty)
+{
+    memset(tty->dirty, 0xFF, sizeof(tty->dirty));
+}
+
+/*
+ * Blanks a row of cells.
+ */
+static void
+tty_clear_row(struct tty *tty, struct tty_cell *row)
+{
+    for (uint32_t i = 0; i < tty->t_ws_col; ++i) {
+        row[i].ch = ' ';
+        row[i].fg = tty->fg;
+        row[i].bg = tty->bg;
+    }
 }
 
 /*
@@ -107,22 +346,124 @@ tty_draw_cursor(struct tty *tty, bool hide)
             fb_ptr[idx] = color;
         }
     }
+
+    tty_damage(tty, tty->curspos_x, tty->curspos_y, CURSOR_WIDTH,
+               CURSOR_HEIGHT);
+}
+
+/*
+ * Moves the pixels of the screen up by
+ * `nrows` rows of text in a single pass,
+ * leaving the rows it uncovers as they are.
+ *
+ * Call with TTY locked.
+ */
+static void
+tty_move_up(struct tty *tty, uint32_t nrows)
+{
+    uint32_t *fb_ptr;
+    size_t dest_idx, src_idx;
+    uint32_t nlines, dist;
+
+#if defined(TTY_BENCH)
+    ++bench_moves;
+    bench_rows += nrows;
+#endif      /* defined(TTY_BENCH) */
+
+    fb_ptr = tty->fbdev.mem;
+    dist = nrows * FONT_HEIGHT;
+    nlines = (tty->t_ws_row - nrows) * FONT_HEIGHT;
+
+    for (uint32_t y = 0; y < nlines; ++y) {
+        dest_idx = fbdev_get_index(&tty->fbdev, 0, y);
+        src_idx = fbdev_get_index(&tty->fbdev, 0, y + dist);
+        memcpy32(&fb_ptr[dest_idx], &fb_ptr[src_idx], tty->t_ws_xpixel);
+    }
+
+    tty_damage(tty, 0, 0, tty->t_ws_xpixel, tty->t_ws_ypixel);
 }
 
+/*
+ * Fills `nrows` rows of text starting
+ * at `row` with the background color.
+ *
+ * Call with TTY locked.
+ */
 static void
-tty_scroll_single(struct tty *tty)
+tty_blank_rows(struct tty *tty, uint32_t row, uint32_t nrows)
 {
     uint32_t *fb_ptr;
-    size_t line_size, dest_idx, src_idx;
+    size_t idx;
+    uint32_t y, end;
 
     fb_ptr = tty->fbdev.mem;
-    line_size = tty->fbdev.pitch/4;
+    y = row * FONT_HEIGHT;
+    end = (row + nrows) * FONT_HEIGHT;
 
-    /* Copy each line up */
-    for (size_t y = FONT_HEIGHT; y < tty->t_ws_ypixel; y += FONT_HEIGHT) {
-        dest_idx = fbdev_get_index(&tty->fbdev, 0, y - FONT_HEIGHT);
-        src_idx = fbdev_get_index(&tty->fbdev, 0, y);
-        memcpy32(&fb_ptr[dest_idx], &fb_ptr[src_idx], FONT_HEIGHT*line_size);
+    for (; y < end; ++y) {
+        idx = fbdev_get_index(&tty->fbdev, 0, y);
+        for (uint32_t x = 0; x < tty->t_ws_xpixel; ++x) {
+            fb_ptr[idx + x] = tty->bg;
+        }
+    }
+
+    tty_damage(tty, 0, row * FONT_HEIGHT, tty->t_ws_xpixel,
+               nrows * FONT_HEIGHT);
+}
+
+/*
+ * Moves the dirty bits up by `nrows` rows along
+ * with the text, the rows uncovered at the
+ * bottom are dirty.
+ */
+static void
+tty_shift_dirty(struct tty *tty, uint32_t nrows)
+{
+    const size_t NWORDS = __ARRAY_COUNT(tty->dirty);
+    size_t words, bits, src;
+    uint64_t lo, hi;
+
+    words = nrows / 64;
+    bits = nrows % 64;
+
+    for (size_t i = 0; i < NWORDS; ++i) {
+        src = i + words;
+        lo = (src < NWORDS) ? tty->dirty[src] : 0;
+        hi = (src + 1 < NWORDS) ? tty->dirty[src + 1] : 0;
+        tty->dirty[i] = (bits == 0) ? lo : (lo >> bits) | (hi << (64 - bits));
+    }
+
+    for (uint32_t row = tty->t_ws_row - nrows; row < tty->t_ws_row; ++row) {
+        tty_mark_row(tty, row);
+    }
+}
+
+/*
+ * Scrolls up by `nrows` rows. With cells this only
+ * moves the head of the ring, the pixels are moved
+ * once for every scroll since the last tty_present()
+ * and only rows that come into view are repainted.
+ *
+ * Call with TTY locked.
+ */
+static void
+tty_scroll(struct tty *tty, size_t nrows)
+{
+    /* Past a screenful it all looks the same */
+    nrows = __MIN(nrows, tty->t_ws_row);
+
+    if (tty->cells != NULL) {
+        tty->head = (tty->head + nrows) % tty->t_ws_row;
+        for (uint32_t row = tty->t_ws_row - nrows; row < tty->t_ws_row; ++row) {
+            tty_clear_row(tty, tty_cell_row(tty, row));
+        }
+        tty_shift_dirty(tty, nrows);
+        tty->scroll = __MIN(tty->scroll + nrows, tty->t_ws_row);
+    } else {
+        if (nrows < tty->t_ws_row) {
+            tty_move_up(tty, nrows);
+        }
+        tty_blank_rows(tty, tty->t_ws_row - nrows, nrows);
     }
 
     /*
@@ -134,19 +475,90 @@ tty_scroll_single(struct tty *tty)
 }
 
 /*
- * Handles a newline.
+ * Repaints the dirty rows from their cells.
  *
  * Call with TTY locked.
  */
-static inline void
-tty_newline(struct tty *tty)
+static void
+tty_render(struct tty *tty)
+{
+    const struct tty_cell *cells;
+    uint32_t rows, cols, y;
+
+    rows = __MIN(tty->t_ws_row, TTY_MAX_ROWS);
+    cols = tty->t_ws_col;
+    for (uint32_t row = 0; row < rows; ++row) {
+        if (!__TEST(tty->dirty[row / 64], __BIT(row % 64))) {
+            continue;
+        }
+
+        cells = tty_cell_row(tty, row);
+        y = row * FONT_HEIGHT;
+        for (uint32_t col = 0; col < cols; ++col) {
+            tty_draw_glyph(tty, col * FONT_WIDTH, y, cells[col].ch,
+                           cells[col].fg, cells[col].bg);
+        }
+    }
+
+    memset(tty->dirty, 0, sizeof(tty->dirty));
+}
+
+/*
+ * Catches the pixels up with any scrolling, paints
+ * dirty cells and copies the damaged spans of the
+ * backbuffer to the front buffer. Scrolling by a
+ * screenful or more doesn't move anything as every
+ * row gets repainted.
+ *
+ * Call with TTY locked.
+ */
+static void
+tty_present(struct tty *tty)
+{
+    uint32_t *back, *front;
+    const struct tty_rect *rect;
+    size_t src, dest;
+
+    if (tty->cells != NULL) {
+        if (tty->scroll < tty->t_ws_row && tty->scroll > 0) {
+            tty_move_up(tty, tty->scroll);
+        }
+
+        tty->scroll = 0;
+        tty_render(tty);
+    }
+
+    tty_draw_cursor(tty, false);
+    back = tty->fbdev.mem;
+    front = tty->front.mem;
+
+    for (uint8_t i = 0; i < tty->ndamage; ++i) {
+        rect = &tty->damage[i];
+        for (uint32_t y = rect->y; y < rect->y + rect->height; ++y) {
+            src = fbdev_get_index(&tty->fbdev, rect->x, y);
+            dest = fbdev_get_index(&tty->front, rect->x, y);
+            memcpy32(&front[dest], &back[src], rect->width);
+        }
+    }
+
+    tty->ndamage = 0;
+}
+
+
+/*
+ * Handles `n` newlines in one go, moving
+ * down as far as the screen allows and
+ * scrolling by whatever is left.
+ *
+ * Call with TTY locked.
+ */
+static void
+tty_newlines(struct tty *tty, size_t n)
 {
     uint32_t ypos;
+    size_t nadvance;
     const uint32_t MAX_YPOS = tty->t_ws_ypixel - (CURSOR_HEIGHT*2);
 
-    /* Hide the cursor */
-    tty_draw_cursor(tty, true);
-
     /* Reset X positions */
     tty->chpos_x = 0;
     tty->curspos_x = 0;
@@ -158,46 +570,71 @@ tty_newline(struct tty *tty)
     ypos = __MAX(tty->chpos_y, tty->curspos_y);
 
     /*
-     * Check if we need to scroll
-     * instead of incrementing
-     * Y positions.
+     * See how many lines we can move down
+     * by before we'd have to scroll
+     * instead of incrementing Y positions.
      */
+    nadvance = 0;
     if (ypos < MAX_YPOS) {
-        tty->chpos_y += FONT_HEIGHT;
-        tty->curspos_y += FONT_HEIGHT;
-    } else {
-        tty_scroll_single(tty);
+        nadvance = __DIV_ROUNDUP(MAX_YPOS - ypos, FONT_HEIGHT);
+        nadvance = __MIN(nadvance, n);
     }
 
-    /* Redraw the cursor */
-    tty_draw_cursor(tty, false);
+    tty->chpos_y += nadvance * FONT_HEIGHT;
+    tty->curspos_y += nadvance * FONT_HEIGHT;
+
+    if (n > nadvance) {
+        tty_scroll(tty, n - nadvance);
+    }
 }
 
 /*
- * Appends a character to the TTY specified
- * by `tty` as well as incrementing tty->chpos_x
- * and making newlines as needed.
+ * Appends a run of chars to the TTY specified
+ * by `tty`, a line at a time, as well as
+ * incrementing tty->chpos_x and making
+ * newlines as needed.
  *
  * Call with TTY locked.
  */
-static inline void
-tty_append_char(struct tty *tty, int c)
+static void
+tty_put_run(struct tty *tty, const char *buf, size_t len)
 {
     const uint32_t MAX_XPOS = tty->t_ws_xpixel - FONT_WIDTH;
 
-    /* Hide the cursor */
-    tty_draw_cursor(tty, true);
+    struct tty_cell *cell;
+    uint32_t row;
+    size_t n;
+
+    while (len > 0) {
+        /* Chars that fit before we wrap */
+        n = __DIV_ROUNDUP(MAX_XPOS - tty->chpos_x, FONT_WIDTH);
+        n = __MIN(n, len);
+
+        if (tty->cells != NULL) {
+            row = tty->chpos_y / FONT_HEIGHT;
+            cell = &tty_cell_row(tty, row)[tty->chpos_x / FONT_WIDTH];
+            for (size_t i = 0; i < n; ++i) {
+                cell[i].ch = buf[i];
+                cell[i].fg = tty->fg;
+                cell[i].bg = tty->bg;
+            }
+            tty_mark_row(tty, row);
+        } else {
+            for (size_t i = 0; i < n; ++i) {
+                tty_draw_glyph(tty, tty->chpos_x + (i * FONT_WIDTH),
+                               tty->chpos_y, buf[i], tty->fg, tty->bg);
+            }
+        }
 
-    tty_draw_char(tty, c, tty->fg, tty->bg);
-    tty->chpos_x += FONT_WIDTH;
-    tty->curspos_x += FONT_WIDTH;
+        tty->chpos_x += n * FONT_WIDTH;
+        tty->curspos_x += n * FONT_WIDTH;
+        buf += n;
+        len -= n;
 
-    if (tty->chpos_x >= MAX_XPOS) {
-        tty_newline(tty);
+        if (tty->chpos_x >= MAX_XPOS) {
+            tty_newlines(tty, 1);
+        }
     }
-
-    /* Redraw the cursor */
-    tty_draw_cursor(tty, false);
 }
 
 /*
@@ -210,45 +647,57 @@ static void
 tty_expand_tab(struct tty *tty)
 {
     for (size_t i = 0; i < tty->tab_width; ++i) {
-        tty_append_char(tty, ' ');
+        tty_put_run(tty, " ", 1);
     }
 }
 
 /*
- * Writes a char to the TTY.
- *
- * Returns 0 on success; non-zero value
- * is a character to be resent.
+ * Writes `len` bytes from `buf` to the TTY
+ * with output processing if possible. Runs
+ * of printable chars are put out back-to-back
+ * and runs of newlines are handled at once.
  *
- * Call with TTY locked.
+ * Call with TTY locked and the cursor hidden.
  */
-static int
-tty_putch(struct tty *tty, int c)
+static void
+tty_output(struct tty *tty, const char *buf, size_t len)
 {
+    size_t i, start;
+
     if (!__TEST(tty->t_oflag, OPOST)) {
         /*
-         * Just write out the char with
+         * Just write out the chars with
          * no processing.
          */
-        tty_append_char(tty, c);
-        return 0;
+        tty_put_run(tty, buf, len);
+        return;
     }
 
-    switch (c) {
-    case ASCII_HT:
-        /* Tab */
-        tty_expand_tab(tty);
-        break;
-    case ASCII_LF:
-        /* Line feed ('\n') */
-        tty_newline(tty);
-        break;
-    default:
-        tty_append_char(tty, c);
-        break;
+    i = 0;
+    while (i < len) {
+        start = i;
+
+        switch (buf[i]) {
+        case ASCII_HT:
+            /* Tab */
+            tty_expand_tab(tty);
+            ++i;
+            break;
+        case ASCII_LF:
+            /* Line feeds ('\n') */
+            while (i < len && buf[i] == ASCII_LF) {
+                ++i;
+            }
+            tty_newlines(tty, i - start);
+            break;
+        default:
+            while (i < len && buf[i] != ASCII_HT && buf[i] != ASCII_LF) {
+                ++i;
+            }
+            tty_put_run(tty, &buf[start], i - start);
+            break;
+        }
     }
-
-    return 0;
 }
 
 /*
@@ -264,20 +713,22 @@ tty_flush(struct tty *tty)
 
     ring = &tty->ring;
 
+    if (tty->cells == NULL) {
+        /* Keep it for once we have cells */
+        for (size_t i = 0; i < ring->len; ++i) {
+            tty->bootlog[tty->bootlog_len++ % TTY_BOOTLOG_SIZE] = ring->buf[i];
+        }
+    }
+
     /*
-     * Write each byte from the buffer
-     * to the screen with output processing
-     * if possible.
-     *
-     * XXX: Perhaps there could be a faster
-     *      way of doing this instead of
-     *      byte by byte?
+     * Hide the cursor for the whole flush,
+     * tty_present() puts it back.
      */
-    for (size_t i = 0; i < ring->len; ++i) {
-        tty_putch(tty, ring->buf[i]);
-    }
+    tty_draw_cursor(tty, true);
+    tty_output(tty, ring->buf, ring->len);
 
     ring->len = 0;
+    tty_present(tty);
 }
 
 /*
@@ -292,6 +743,8 @@ tty_flush(struct tty *tty)
 ssize_t
 tty_write(struct tty *tty, const char *buf, size_t len)
 {
+    bool newline = false;
+
     if (len == 0) {
         /* Bad value, don't even try */
         return EXIT_FAILURE;
@@ -300,22 +753,19 @@ tty_write(struct tty *tty, const char *buf, size_t len)
     TTY_LOCK(tty);
     for (size_t i = 0; i < len; ++i) {
         tty_push_char(tty, buf[i]);
-        /*
-         * If we have a newline and we are
-         * buffering bytes, flush the ring.
-         */
-        if (buf[i] == '\n' && __TEST(tty->t_oflag, ORBUF)) {
-            tty_flush(tty);
+        if (buf[i] == '\n') {
+            newline = true;
         }
     }
 
     /*
-     * If we aren't buffering bytes, don't
-     * keep the bytes within the ring and
-     * flush it right away per `tty_write()`
-     * call.
+     * Flush once per `tty_write()` call, so a
+     * write of many lines is drawn in one go. If
+     * we are buffering bytes, only do so once
+     * a line is complete. A full ring is flushed
+     * by tty_push_char() regardless.
      */
-    if (!__TEST(tty->t_oflag, ORBUF)) {
+    if (!__TEST(tty->t_oflag, ORBUF) || newline) {
         tty_flush(tty);
     }
 
@@ -339,12 +789,12 @@ tty_set_defaults(struct tty *tty)
      * ------------------------------------------------
      *  The default framebuffer device should be the
      *  front buffer. Later on during boot, all attached
-     *  TTYs shall have their fbdev swapped out with a
-     *  backbuffer to improve performace as reading directly
-     *  from video memory is going to be slow.
+     *  TTYs have their fbdev swapped out with a backbuffer
+     *  by tty_backbuffer_init() to improve performace as
+     *  reading directly from video memory is going to be
+     *  slow.
      *
-     *  XXX: At some point we should be allocating a backbuffer
-     *       instead when it's time for *all* TTYs to have them.
+     *  XXX: Every attached TTY gets a backbuffer for now.
      *
      *       A good idea would be to only allocate a backbuffer
      *       *if* we switched to some TTY and deallocate
@@ -377,8 +827,158 @@ void
 tty_attach(struct tty *tty)
 {
     TAILQ_INSERT_TAIL(&tty_list, tty, link);
-    tty_draw_cursor(tty, false);
+    tty_present(tty);
+}
+
+/*
+ * Starts off freshly allocated cells with whatever
+ * was written before, so they match the screen.
+ * Only the last TTY_BOOTLOG_SIZE bytes are kept.
+ *
+ * Call with TTY locked.
+ */
+static void
+tty_cells_init(struct tty *tty)
+{
+    size_t start, off, len;
+
+    tty->head = 0;
+    for (uint32_t row = 0; row < tty->t_ws_row; ++row) {
+        tty_clear_row(tty, tty_cell_row(tty, row));
+    }
+
+    tty->chpos_x = 0;
+    tty->chpos_y = 0;
+    tty->curspos_x = 0;
+    tty->curspos_y = 0;
+
+    start = 0;
+    if (tty->bootlog_len > TTY_BOOTLOG_SIZE) {
+        start = tty->bootlog_len - TTY_BOOTLOG_SIZE;
+    }
+    for (size_t i = start; i < tty->bootlog_len; i += len) {
+        /* At most two pieces, if it wrapped */
+        off = i % TTY_BOOTLOG_SIZE;
+        len = __MIN(tty->bootlog_len - i, TTY_BOOTLOG_SIZE - off);
+        tty_output(tty, &tty->bootlog[off], len);
+    }
+
+    /* Every row gets repainted anyway */
+    tty->scroll = 0;
+
+    tty_mark_all(tty);
+    tty_present(tty);
+}
+
+/*
+ * Moves every attached TTY onto a backbuffer in
+ * system RAM, so nothing reads video memory past
+ * here and only damaged areas are written to it.
+ * They also get a glyph cache and a grid of cells
+ * to draw from.
+ *
+ * TTYs that can't get one keep drawing onto
+ * the front buffer.
+ *
+ * => Needs vmalloc().
+ */
+void
+tty_backbuffer_init(void)
+{
+    struct tty *tty;
+    struct fbdev back;
+    struct tty_glyph_cache *glyphs;
+    struct tty_cell *cells;
+    uint32_t *src;
+    size_t ncells;
+
+    TAILQ_FOREACH(tty, &tty_list, link) {
+        if (tty->backbuffer) {
+            continue;
+        }
+
+        /* Allocate unlocked, vmalloc() may kprintf() to us */
+        back = tty->fbdev;
+        back.pitch = back.width * 4;
+        back.mem = vmalloc((size_t)back.pitch * back.height);
+        if (back.mem == NULL) {
+            continue;
+        }
+
+        if ((glyphs = vmalloc(sizeof(*glyphs))) != NULL) {
+            tty_glyph_init(glyphs);
+        }
+
+        ncells = (size_t)tty->t_ws_row * tty->t_ws_col;
+        cells = vmalloc(ncells * sizeof(struct tty_cell));
+
+        /* The last read of the front buffer */
+        TTY_LOCK(tty);
+        src = tty->fbdev.mem;
+        for (uint32_t y = 0; y < back.height; ++y) {
+            memcpy32((uint32_t *)back.mem + fbdev_get_index(&back, 0, y),
+                     &src[fbdev_get_index(&tty->fbdev, 0, y)], back.width);
+        }
+
+        tty->front = tty->fbdev;
+        tty->fbdev = back;
+        tty->ndamage = 0;
+        tty->backbuffer = true;
+        tty->glyphs = glyphs;
+
+        if ((tty->cells = cells) != NULL) {
+            tty_cells_init(tty);
+        }
+        TTY_UNLOCK(tty);
+    }
+}
+
+#if defined(TTY_BENCH)
+/*
+ * Times a fixed burst of kprintf() output, one
+ * line per call, and reports the cycles it took
+ * per char.
+ *
+ * Then prints TTY_BENCH_BLOCK lines at the bottom
+ * of the screen with one kprintf() and reports how
+ * often the pixels were moved for it, which should
+ * be once by TTY_BENCH_BLOCK rows.
+ *
+ * @label: What is being measured (e.g "backbuffer")
+ */
+void
+tty_bench(const char *label)
+{
+    static const char line[] =
+        "tty: The quick brown fox jumps over the lazy dog 0123456789";
+    char block[TTY_BENCH_BLOCK * 2 + 1];
+    uint64_t start, cycles;
+    size_t moves, rows;
+
+    start = rdtsc();
+    for (size_t i = 0; i < TTY_BENCH_LINES; ++i) {
+        kprintf("%s\n", line);
+    }
+    cycles = rdtsc() - start;
+
+    for (size_t i = 0; i < TTY_BENCH_BLOCK; ++i) {
+        block[i * 2] = '.';
+        block[i * 2 + 1] = '\n';
+    }
+    block[TTY_BENCH_BLOCK * 2] = '\0';
+
+    bench_moves = 0;
+    bench_rows = 0;
+    kprintf("%s", block);
+    moves = bench_moves;
+    rows = bench_rows;
+
+    KINFO("%s: %d cycles/char\n", label,
+          cycles / (TTY_BENCH_LINES * sizeof(line)));
+    KINFO("%s: %d lines in one write, %d move(s) of %d rows\n", label,
+          TTY_BENCH_BLOCK, moves, rows);
 }
+#endif      /* defined(TTY_BENCH) */
 
 void
 tty_init(void)
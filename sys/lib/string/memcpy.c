@@ -41,12 +41,31 @@ memcpy(void *dest, const void *src, size_t n)
     return dest;
 }
 
+/*
+ * Copies `n` 32-bit words, the framebuffer copies
+ * of the TTY go through here. Eight words are moved
+ * per iteration as the kernel is built without -O.
+ */
 void *
 memcpy32(void *dest, const void *src, size_t n)
 {
-        for (size_t i = 0; i < n; ++i) {
-                ((uint32_t *)dest)[i] = ((uint32_t *)src)[i];
-        }
+    uint32_t *d = dest;
+    const uint32_t *s = src;
+
+    for (; n >= 8; n -= 8, d += 8, s += 8) {
+        d[0] = s[0];
+        d[1] = s[1];
+        d[2] = s[2];
+        d[3] = s[3];
+        d[4] = s[4];
+        d[5] = s[5];
+        d[6] = s[6];
+        d[7] = s[7];
+    }
 
-        return dest;
+    while (n-- > 0) {
+        *d++ = *s++;
+    }
+
+    return dest;
 }
@@ -29,9 +29,29 @@
 
 /* $Id$ */
 
+#include <sys/cdefs.h>
+#include <sys/panic.h>
 #include <vm/vm.h>
 
 volatile struct limine_hhdm_request g_hhdm_request = {
     .id = LIMINE_HHDM_REQUEST,
     .revision = 0
 };
+
+struct vmem g_kva_arena;
+
+/*
+ * Sets up the kernel virtual address arena,
+ * needs the slab allocator for boundary tags.
+ */
+void
+vm_kva_init(void)
+{
+    int error;
+
+    error = vmem_init(&g_kva_arena, "kva", VM_KVA_BASE, VM_KVA_SIZE,
+                      PAGE_SIZE, VM_KVA_QCACHE_MAX);
+    if (error != 0) {
+        panic("Failed to set up the kernel VA arena (error %d)\n", error);
+    }
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2023 Ian Marco Moffett and the VegaOS team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of VegaOS nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#include <sys/cdefs.h>
+#include <sys/syslog.h>
+#include <vm/vm_bootmem.h>
+#include <vm/vm.h>
+
+__MODULE_NAME("vm_bootmem");
+__KERNEL_META("$Vega$: vm_bootmem.c, Ian Marco Moffett, "
+              "Boot time arena allocator");
+
+#if defined(VM_BOOTMEM_DEBUG)
+#define DPRINTF(...) KDEBUG(__VA_ARGS__)
+#else
+#define DPRINTF(...) __nothing
+#endif      /* defined(VM_BOOTMEM_DEBUG) */
+
+/*
+ * Memory for data structures needed before the
+ * page allocator is up, bumped off the front of the
+ * largest usable memory map entry. Whatever isn't
+ * used goes to the page allocator afterwards.
+ *
+ * All addresses here are physical.
+ */
+static paddr_t arena_start = 0;
+static paddr_t arena_cur = 0;
+static paddr_t arena_end = 0;
+
+/*
+ * Picks the arena out of the memory map.
+ *
+ * => The memory map must not be modified
+ *    until vm_bootmem_done().
+ */
+void
+vm_bootmem_init(struct limine_memmap_response *resp)
+{
+    struct limine_memmap_entry *entry, *best;
+
+    best = NULL;
+    for (size_t i = 0; i < resp->entry_count; ++i) {
+        entry = resp->entries[i];
+
+        /* Frame 0 is never handed out, stay clear of it */
+        if (entry->type != LIMINE_MEMMAP_USABLE || entry->base == 0) {
+            continue;
+        }
+        if (best == NULL || entry->length > best->length) {
+            best = entry;
+        }
+    }
+
+    if (best == NULL) {
+        return;
+    }
+
+    arena_start = best->base;
+    arena_cur = best->base;
+    arena_end = best->base + best->length;
+    DPRINTF("Arena at 0x%x - 0x%x\n", arena_start, arena_end);
+}
+
+/*
+ * Allocates `size` bytes aligned to `align`
+ * (a power of two), contents are undefined.
+ *
+ * Returns NULL if the arena is used up or
+ * vm_bootmem_done() has been called.
+ */
+void *
+vm_bootmem_alloc(size_t size, size_t align)
+{
+    paddr_t addr;
+
+    if (align == 0) {
+        align = sizeof(void *);
+    }
+
+    addr = __ALIGN_UP(arena_cur, align);
+    if (arena_cur == 0 || addr + size > arena_end || addr + size < addr) {
+        return NULL;
+    }
+
+    arena_cur = addr + size;
+    return PHYS_TO_VIRT(addr);
+}
+
+/*
+ * Returns a mark to later release everything
+ * allocated past this point with.
+ */
+uintptr_t
+vm_bootmem_mark(void)
+{
+    return arena_cur;
+}
+
+/*
+ * Frees everything allocated since
+ * vm_bootmem_mark() returned `mark`.
+ */
+void
+vm_bootmem_release(uintptr_t mark)
+{
+    if (mark >= arena_start && mark <= arena_cur) {
+        arena_cur = mark;
+    }
+}
+
+/*
+ * Closes the arena, no more allocations are made
+ * from it. Stores the (page aligned) range actually
+ * used into `start` and `end` so the rest can be
+ * given to the page allocator.
+ */
+void
+vm_bootmem_done(paddr_t *start, paddr_t *end)
+{
+    *start = arena_start;
+    *end = __ALIGN_UP(arena_cur, PAGE_SIZE);
+
+    DPRINTF("Arena done, %d bytes used\n", arena_cur - arena_start);
+    arena_cur = 0;
+}
@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2023 Ian Marco Moffett and the VegaOS team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of VegaOS nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#include <sys/cdefs.h>
+#include <sys/syslog.h>
+#include <sys/errno.h>
+#include <sys/queue.h>
+#include <sys/spinlock.h>
+#include <sys/vmem.h>
+#include <machine/tsc.h>
+#include <vm/vm_fault.h>
+#include <vm/vm_physseg.h>
+#include <vm/vm_slab.h>
+#include <vm/pmap.h>
+#include <vm/vm.h>
+
+__MODULE_NAME("vm_fault");
+__KERNEL_META("$Vega$: vm_fault.c, Ian Marco Moffett, "
+              "Page fault handling and lazily backed regions");
+
+#if defined(VM_FAULT_DEBUG)
+#define DPRINTF(...) KDEBUG(__VA_ARGS__)
+#else
+#define DPRINTF(...) __nothing
+#endif      /* defined(VM_FAULT_DEBUG) */
+
+/* Frames unmapped before each pmap_update() in vm_lazy_free() */
+#define LAZY_CHUNK 64
+
+/*
+ * A range of kernel VA whose pages are only
+ * backed by a (zeroed) frame once touched.
+ */
+struct vm_lazy {
+    TAILQ_ENTRY(vm_lazy) link;
+    vaddr_t start;
+    size_t size;
+};
+
+static TAILQ_HEAD(, vm_lazy) lazy_list = TAILQ_HEAD_INITIALIZER(lazy_list);
+static struct spinlock lazy_lock = { 0 };
+static struct vm_fault_stats stats = { 0 };
+
+/*
+ * Returns the region `va` is within.
+ *
+ * => Call with `lazy_lock` held.
+ */
+static struct vm_lazy *
+vm_lazy_lookup(vaddr_t va)
+{
+    struct vm_lazy *lazy;
+
+    TAILQ_FOREACH(lazy, &lazy_list, link) {
+        if (va >= lazy->start && va < lazy->start + lazy->size) {
+            return lazy;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Backs the page at `va` with a zeroed
+ * frame if it is within a lazy region.
+ *
+ * => Call with `lazy_lock` held.
+ */
+static int
+vm_fault_lazy(vaddr_t va)
+{
+    struct pmap *pmap = pmap_kernel();
+    uintptr_t frame;
+    paddr_t pa;
+
+    if (vm_lazy_lookup(va) == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    /* Someone else may have beaten us to it */
+    if (pmap_extract(pmap, va, &pa)) {
+        return 0;
+    }
+
+    if ((frame = vm_alloc_pageframe(1, VM_ALLOC_ZERO)) == 0) {
+        DPRINTF("Out of frames backing 0x%x\n", va);
+        return EXIT_FAILURE;
+    }
+
+    if (pmap_enter(pmap, va, frame, PMAP_WRITABLE) != 0) {
+        vm_free_pageframe(frame, 1);
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
+
+/*
+ * Tries to resolve a fault on `va`, `access`
+ * being the VM_FAULT_* bits describing it.
+ *
+ * Returns 0 if the access can be retried,
+ * EXIT_FAILURE if it was invalid.
+ */
+int
+vm_fault(vaddr_t va, int access)
+{
+    uint64_t start, cycles;
+    int error = EXIT_FAILURE;
+
+    start = rdtsc();
+    va = __ALIGN_DOWN(va, PAGE_SIZE);
+
+    spinlock_acquire(&lazy_lock);
+
+    /* Only kernel data pages that aren't there yet */
+    if (!__TEST(access, VM_FAULT_PROT | VM_FAULT_USER | VM_FAULT_EXEC)) {
+        error = vm_fault_lazy(va);
+    }
+
+    if (error != 0) {
+        ++stats.invalid;
+        spinlock_release(&lazy_lock);
+        return error;
+    }
+
+    cycles = rdtsc() - start;
+    ++stats.minor;
+    stats.cycles += cycles;
+    stats.max_cycles = __MAX(stats.max_cycles, cycles);
+    spinlock_release(&lazy_lock);
+    return 0;
+}
+
+/*
+ * Fetches page fault statistics.
+ */
+void
+vm_fault_stats(struct vm_fault_stats *res)
+{
+    spinlock_acquire(&lazy_lock);
+    *res = stats;
+    spinlock_release(&lazy_lock);
+}
+
+/*
+ * Reserves `size` bytes of kernel VA, backed a page
+ * at a time as they're first touched. Suited to big
+ * tables and stacks that are mostly never used.
+ *
+ * Returns NULL on failure.
+ */
+void *
+vm_lazy_alloc(size_t size)
+{
+    struct vm_lazy *lazy;
+    vmem_addr_t va;
+
+    if (size == 0) {
+        return NULL;
+    }
+
+    if ((lazy = kmalloc(sizeof(*lazy))) == NULL) {
+        return NULL;
+    }
+
+    size = __ALIGN_UP(size, PAGE_SIZE);
+    if (vmem_alloc(&g_kva_arena, size, VMEM_INSTANTFIT, &va) != 0) {
+        kfree(lazy);
+        return NULL;
+    }
+
+    lazy->start = va;
+    lazy->size = size;
+
+    spinlock_acquire(&lazy_lock);
+    TAILQ_INSERT_TAIL(&lazy_list, lazy, link);
+    spinlock_release(&lazy_lock);
+    return (void *)va;
+}
+
+/*
+ * Frees a region from vm_lazy_alloc() along
+ * with whatever frames ended up backing it.
+ */
+void
+vm_lazy_free(void *ptr)
+{
+    struct pmap *pmap = pmap_kernel();
+    struct vm_lazy *lazy;
+    paddr_t frames[LAZY_CHUNK];
+    vaddr_t va, end;
+    size_t n;
+
+    spinlock_acquire(&lazy_lock);
+    if ((lazy = vm_lazy_lookup((vaddr_t)ptr)) == NULL) {
+        spinlock_release(&lazy_lock);
+        return;
+    }
+
+    TAILQ_REMOVE(&lazy_list, lazy, link);
+    spinlock_release(&lazy_lock);
+
+    va = lazy->start;
+    end = lazy->start + lazy->size;
+    while (va < end) {
+        for (n = 0; n < LAZY_CHUNK && va < end; va += PAGE_SIZE) {
+            if (pmap_extract(pmap, va, &frames[n])) {
+                pmap_remove(pmap, va);
+                ++n;
+            }
+        }
+
+        /* Frames can't be reused until the TLB forgets them */
+        pmap_update(pmap);
+        for (size_t i = 0; i < n; ++i) {
+            vm_free_pageframe(frames[i], 1);
+        }
+    }
+
+    vmem_free(&g_kva_arena, lazy->start, lazy->size);
+    kfree(lazy);
+}
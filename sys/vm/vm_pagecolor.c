@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2023 Ian Marco Moffett and the VegaOS team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of VegaOS nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#include <sys/cdefs.h>
+#include <sys/syslog.h>
+#include <sys/spinlock.h>
+#include <sys/machdep.h>
+#include <vm/vm_pagecolor.h>
+#include <vm/vm_physseg.h>
+#include <vm/vm_page.h>
+#include <vm/vm.h>
+#include <string.h>
+
+__MODULE_NAME("vm_pagecolor");
+__KERNEL_META("$Vega$: vm_pagecolor.c, Ian Marco Moffett, "
+              "Cache colored frame allocation");
+
+#if defined(VM_PAGECOLOR_DEBUG)
+#define DPRINTF(...) KDEBUG(__VA_ARGS__)
+#else
+#define DPRINTF(...) __nothing
+#endif      /* defined(VM_PAGECOLOR_DEBUG) */
+
+/*
+ * Frames that map to the same sets of the last level
+ * cache share a color, so subsystems given disjoint
+ * color sets can't evict each other's lines.
+ *
+ * Free frames of each color are kept on a queue
+ * through their vm_page, refilled a run of frames
+ * at a time when a wanted color runs dry.
+ */
+static struct vm_pageq colorq[VM_NCOLORS_MAX];
+static size_t colorq_len[VM_NCOLORS_MAX];
+static size_t ncolors = 1;
+static struct spinlock color_lock = { 0 };
+
+/*
+ * Takes a frame off the queue of any color
+ * within `set`, returns 0 if they're all empty.
+ *
+ * => Call with `color_lock` held.
+ */
+static uintptr_t
+vm_pagecolor_take(const struct vm_colorset *set)
+{
+    struct vm_page *pg;
+
+    for (size_t color = 0; color < ncolors; ++color) {
+        if (colorq_len[color] == 0 || !vm_colorset_has(set, color)) {
+            continue;
+        }
+
+        pg = TAILQ_FIRST(&colorq[color]);
+        TAILQ_REMOVE(&colorq[color], pg, pageq);
+        --colorq_len[color];
+        pg->flags &= ~VM_PAGE_COLORQ;
+        return pg->phys;
+    }
+
+    return 0;
+}
+
+/*
+ * Puts the free frame at `phys` onto its color
+ * queue, returns false if that queue is full.
+ *
+ * => Call with `color_lock` held.
+ */
+static bool
+vm_pagecolor_put(uintptr_t phys)
+{
+    struct vm_page *pg;
+    size_t color;
+
+    color = vm_page_color(phys);
+    if (colorq_len[color] >= VM_PAGECOLOR_DEPTH) {
+        return false;
+    }
+
+    pg = vm_page_lookup(phys);
+    pg->refcnt = 0;
+    pg->flags = VM_PAGE_COLORQ;
+    TAILQ_INSERT_TAIL(&colorq[color], pg, pageq);
+    ++colorq_len[color];
+    return true;
+}
+
+/*
+ * Fallback for when no run of frames is left: sorts
+ * up to `ncolors` single frames onto the queues. Those
+ * that don't fit are only freed at the end, otherwise
+ * the next batch would just be them again.
+ *
+ * Returns a frame within `set`, or 0 if none of the
+ * frames were.
+ */
+static uintptr_t
+vm_pagecolor_scatter(const struct vm_colorset *set)
+{
+    uintptr_t frames[VM_PAGECOLOR_BATCH];
+    struct vm_pageq spill;
+    struct vm_page *pg;
+    uintptr_t phys = 0;
+    size_t n, total = 0;
+
+    TAILQ_INIT(&spill);
+    while (total < ncolors && phys == 0) {
+        if ((n = vm_physseg_alloc_batch(frames, VM_PAGECOLOR_BATCH)) == 0) {
+            break;
+        }
+
+        total += n;
+        spinlock_acquire(&color_lock);
+        for (size_t i = 0; i < n; ++i) {
+            if (phys == 0 && vm_colorset_has(set, vm_page_color(frames[i]))) {
+                phys = frames[i];
+            } else if (!vm_pagecolor_put(frames[i])) {
+                pg = vm_page_lookup(frames[i]);
+                TAILQ_INSERT_TAIL(&spill, pg, pageq);
+            }
+        }
+        spinlock_release(&color_lock);
+    }
+
+    n = 0;
+    while ((pg = TAILQ_FIRST(&spill)) != NULL) {
+        TAILQ_REMOVE(&spill, pg, pageq);
+        frames[n++] = pg->phys;
+        if (n == VM_PAGECOLOR_BATCH) {
+            vm_physseg_free_batch(frames, n);
+            n = 0;
+        }
+    }
+
+    vm_physseg_free_batch(frames, n);
+    return phys;
+}
+
+/*
+ * Allocates a naturally aligned run of `ncolors`
+ * frames, which holds exactly one frame of every
+ * color. The first within `set` is taken, the rest
+ * go onto the color queues or are freed if those
+ * are full.
+ *
+ * The frame kept stops the run from merging back
+ * together, so the next refill gets a different one.
+ *
+ * Returns the frame taken, or 0 on failure.
+ */
+static uintptr_t
+vm_pagecolor_refill(const struct vm_colorset *set)
+{
+    uintptr_t base, frame, phys = 0;
+    bool queued;
+
+    /* Draining the queues here would only undo the refill */
+    if ((base = vm_alloc_pageframe(ncolors, VM_ALLOC_NODRAIN)) == 0) {
+        return vm_pagecolor_scatter(set);
+    }
+
+    for (size_t color = 0; color < ncolors; ++color) {
+        frame = base + color * PAGE_SIZE;
+        if (phys == 0 && vm_colorset_has(set, color)) {
+            phys = frame;
+            continue;
+        }
+
+        spinlock_acquire(&color_lock);
+        queued = vm_pagecolor_put(frame);
+        spinlock_release(&color_lock);
+
+        if (!queued) {
+            vm_free_pageframe(frame, 1);
+        }
+    }
+
+    return phys;
+}
+
+/*
+ * Returns the color of the frame at `phys`.
+ */
+size_t
+vm_page_color(uintptr_t phys)
+{
+    return (phys / PAGE_SIZE) & (ncolors - 1);
+}
+
+/*
+ * Returns the number of page colors in use.
+ */
+size_t
+vm_page_ncolors(void)
+{
+    return ncolors;
+}
+
+/*
+ * Allocates a single frame whose color is within
+ * `set`. Takes VM_ALLOC_ZERO like vm_alloc_pageframe(),
+ * and is freed with vm_free_colored().
+ *
+ * Returns the physical address of the frame,
+ * or 0 on failure.
+ */
+uintptr_t
+vm_alloc_colored(const struct vm_colorset *set, int flags)
+{
+    struct vm_page *pg;
+    uintptr_t phys;
+
+    spinlock_acquire(&color_lock);
+    phys = vm_pagecolor_take(set);
+    spinlock_release(&color_lock);
+
+    if (phys == 0 && (phys = vm_pagecolor_refill(set)) == 0) {
+        DPRINTF("No frames of the wanted colors\n");
+        return 0;
+    }
+
+    pg = vm_page_lookup(phys);
+    pg->refcnt = 1;
+    pg->flags = 0;
+
+    if (__TEST(flags, VM_ALLOC_ZERO)) {
+        memset(PHYS_TO_VIRT(phys), 0, PAGE_SIZE);
+    }
+
+    return phys;
+}
+
+/*
+ * Frees a frame from vm_alloc_colored(), it goes
+ * back onto its color queue unless that is full.
+ */
+void
+vm_free_colored(uintptr_t phys)
+{
+    bool queued;
+
+    if (vm_page_lookup(phys) == NULL) {
+        return;
+    }
+
+    spinlock_acquire(&color_lock);
+    queued = vm_pagecolor_put(phys);
+    spinlock_release(&color_lock);
+
+    if (!queued) {
+        vm_free_pageframe(phys, 1);
+    }
+}
+
+/*
+ * Gives every frame on the color queues back to
+ * the buddy allocator, for when it runs dry.
+ *
+ * Returns the number of frames given back.
+ */
+size_t
+vm_pagecolor_drain(void)
+{
+    uintptr_t frames[VM_PAGECOLOR_BATCH];
+    struct vm_page *pg;
+    size_t color, n, total = 0;
+
+    color = 0;
+    do {
+        n = 0;
+        spinlock_acquire(&color_lock);
+        for (; color < ncolors && n < VM_PAGECOLOR_BATCH; ++color) {
+            while (n < VM_PAGECOLOR_BATCH &&
+                   (pg = TAILQ_FIRST(&colorq[color])) != NULL) {
+                TAILQ_REMOVE(&colorq[color], pg, pageq);
+                --colorq_len[color];
+                pg->flags &= ~VM_PAGE_COLORQ;
+                frames[n++] = pg->phys;
+            }
+
+            if (colorq_len[color] > 0) {
+                /* Out of room, carry on with this color */
+                break;
+            }
+        }
+        spinlock_release(&color_lock);
+
+        vm_physseg_free_batch(frames, n);
+        total += n;
+    } while (n > 0);
+
+    if (total > 0) {
+        DPRINTF("Drained %d frames\n", total);
+    }
+
+    return total;
+}
+
+/*
+ * Works out the number of page colors from the
+ * cache geometry, folded down to a power of two
+ * no greater than VM_NCOLORS_MAX.
+ */
+void
+vm_pagecolor_init(void)
+{
+    size_t colors;
+
+    colors = __MIN(processor_cache_colors(), VM_NCOLORS_MAX);
+    while (ncolors * 2 <= colors) {
+        ncolors *= 2;
+    }
+
+    for (size_t i = 0; i < ncolors; ++i) {
+        TAILQ_INIT(&colorq[i]);
+        colorq_len[i] = 0;
+    }
+
+    KINFO("%d page colors\n", ncolors);
+}
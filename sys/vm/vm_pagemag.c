@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2023 Ian Marco Moffett and the VegaOS team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of VegaOS nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#include <sys/cdefs.h>
+#include <sys/machdep.h>
+#include <vm/vm_pagemag.h>
+#include <vm/vm_physseg.h>
+
+__KERNEL_META("$Vega$: vm_pagemag.c, Ian Marco Moffett, "
+              "Per-processor page frame magazines");
+
+/*
+ * A per-processor magazine of free frames sitting
+ * in front of the physical allocator. Single frame
+ * allocations and frees only touch the magazine of
+ * the current processor, which is refilled from and
+ * drained to the global pool in batches.
+ *
+ * Each magazine sits on its own cachelines so the
+ * fast path never touches shared state other than
+ * the (read-mostly) watermarks.
+ */
+struct vm_pagemag {
+    size_t count;
+    size_t hits;
+    size_t misses;
+    volatile bool drain;        /* Give everything back on next use */
+    uintptr_t frames[VM_PAGEMAG_SIZE];
+} __cacheline_aligned;
+
+static struct vm_pagemag pagemags[MAXCPUS];
+
+/*
+ * `low`: Frames a magazine is refilled to when it runs dry.
+ * `high`: Frames at which a magazine is drained back down to `low`.
+ */
+static size_t pagemag_low = VM_PAGEMAG_LOW;
+static size_t pagemag_high = VM_PAGEMAG_HIGH;
+
+static inline struct vm_pagemag *
+vm_pagemag_this(void)
+{
+    return &pagemags[this_processor()->id];
+}
+
+/*
+ * Gives every frame in `mag` back to the global
+ * pool, where they can coalesce again.
+ *
+ * Returns the number of frames given back.
+ */
+static size_t
+vm_pagemag_empty(struct vm_pagemag *mag)
+{
+    size_t count;
+
+    mag->drain = false;
+    count = mag->count;
+    vm_physseg_free_batch(mag->frames, count);
+    mag->count = 0;
+    return count;
+}
+
+/*
+ * Allocates a single frame from the
+ * current processor's magazine.
+ *
+ * Returns the physical address of the frame,
+ * or 0 if the global pool is exhausted too.
+ *
+ * => Not to be called from interrupt context.
+ */
+uintptr_t
+vm_pagemag_alloc(void)
+{
+    struct vm_pagemag *mag;
+
+    mag = vm_pagemag_this();
+    if (mag->drain) {
+        vm_pagemag_empty(mag);
+    }
+
+    if (mag->count > 0) {
+        ++mag->hits;
+        return mag->frames[--mag->count];
+    }
+
+    ++mag->misses;
+    mag->count = vm_physseg_alloc_batch(mag->frames, pagemag_low);
+    if (mag->count == 0) {
+        return 0;
+    }
+
+    return mag->frames[--mag->count];
+}
+
+/*
+ * Returns a single frame to the current
+ * processor's magazine.
+ *
+ * => Not to be called from interrupt context.
+ */
+void
+vm_pagemag_free(uintptr_t phys)
+{
+    struct vm_pagemag *mag;
+    size_t excess;
+
+    mag = vm_pagemag_this();
+    if (mag->drain) {
+        vm_pagemag_empty(mag);
+    }
+
+    mag->frames[mag->count++] = phys;
+    if (mag->count >= pagemag_high) {
+        excess = mag->count - pagemag_low;
+        vm_physseg_free_batch(&mag->frames[pagemag_low], excess);
+        mag->count = pagemag_low;
+    }
+}
+
+/*
+ * Gives the frames in the current processor's
+ * magazine back to the global pool, for when it
+ * runs dry. Magazines of other processors are
+ * only theirs to touch, they're asked to do the
+ * same on their next allocation or free.
+ *
+ * Returns the number of frames given back.
+ *
+ * => Not to be called from interrupt context.
+ */
+size_t
+vm_pagemag_drain(void)
+{
+    struct vm_pagemag *mag;
+
+    mag = vm_pagemag_this();
+    for (size_t i = 0; i < MAXCPUS; ++i) {
+        if (&pagemags[i] != mag && pagemags[i].count > 0) {
+            pagemags[i].drain = true;
+        }
+    }
+
+    return vm_pagemag_empty(mag);
+}
+
+/*
+ * Sets the watermarks for every magazine,
+ * `low` must be below `high`.
+ *
+ * Magazines above the new high watermark
+ * drain on their next free.
+ */
+void
+vm_pagemag_set_watermarks(size_t low, size_t high)
+{
+    if (low == 0 || low >= high || high > VM_PAGEMAG_SIZE) {
+        return;
+    }
+
+    pagemag_low = low;
+    pagemag_high = high;
+}
+
+/*
+ * Fetches magazine statistics
+ * for processor `cpu`.
+ */
+void
+vm_pagemag_stats(uint32_t cpu, struct vm_pagemag_stats *res)
+{
+    struct vm_pagemag *mag;
+
+    if (cpu >= MAXCPUS) {
+        return;
+    }
+
+    mag = &pagemags[cpu];
+    res->count = mag->count;
+    res->hits = mag->hits;
+    res->misses = mag->misses;
+}
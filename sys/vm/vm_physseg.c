@@ -32,7 +32,16 @@
 #include <sys/limine.h>
 #include <sys/cdefs.h>
 #include <sys/syslog.h>
+#include <sys/spinlock.h>
+#include <sys/machdep.h>
+#include <sys/panic.h>
+#include <machine/tsc.h>
 #include <vm/vm_physseg.h>
+#include <vm/vm_pagemag.h>
+#include <vm/vm_zeropool.h>
+#include <vm/vm_pagecolor.h>
+#include <vm/vm_page.h>
+#include <vm/vm_bootmem.h>
 #include <vm/vm.h>
 #include <bitmap.h>
 #include <string.h>
@@ -67,46 +76,567 @@ __used static const char *segment_name[] = {
 
 static const int MAX_SEGMENTS = __ARRAY_COUNT(segment_name);
 
+/* Max number of usable segments we track */
+#define VM_PHYSSEG_MAX      64
 
-static bitmap_t bitmap = NULL;
-static size_t bitmap_size = 0;
-static size_t bitmap_free_start;    /* Beginning bit of free region */
+/* Max number of summary levels above a buddy map */
+#define VM_BUDDY_SUMMARY_MAX 3
 
+/* Returned instead of a block when there is none (SIZE_MAX) */
+#define VM_BUDDY_NONE       BITMAP_NONE
+
+/*
+ * Binary buddy allocator state for a single order.
+ *
+ * A clear bit in `map` means a free block of this
+ * order begins there; a set bit means the block is
+ * in use, split into smaller blocks or merged into
+ * a bigger one.
+ */
+struct buddy_order {
+    bitmap_t map;
+    size_t nblocks;         /* Blocks covered by `map` */
+    size_t nwords;          /* 64-bit words in `map` */
+    size_t nfree;           /* Free blocks of this order */
+    size_t hint;            /* Next-fit hint for runs (block) */
+
+    /*
+     * Summary levels over `map`. Bit n of level 0 is set
+     * if word n of `map` has a free block, bit n of level
+     * 1 is set if word n of level 0 is non-zero and so on.
+     * Finding a free block walks down from the top level,
+     * touching one word per level however full memory is.
+     */
+    uint64_t *summary[VM_BUDDY_SUMMARY_MAX];
+    size_t summary_nwords[VM_BUDDY_SUMMARY_MAX];
+    int nlevels;
+};
+
+/*
+ * Describes a range of usable physical memory
+ * with its own buddy maps. The maps only cover the
+ * segment itself, so holes in the memory map cost
+ * neither bitmap space nor scan time.
+ *
+ * Block numbers are relative to `base`, which is
+ * `start` aligned down to a top order block so that
+ * blocks stay naturally aligned in physical memory.
+ */
+struct vm_physseg {
+    size_t base;            /* First frame covered by the maps */
+    size_t start;           /* First usable frame */
+    size_t end;             /* Last usable frame + 1 */
+    struct vm_page *pages;  /* One per frame from `start` to `end` */
+    struct buddy_order buddy[VM_BUDDY_MAX_ORDER + 1];
+};
+
+static struct vm_physseg physseg[VM_PHYSSEG_MAX];
+static size_t nphysseg = 0;
+static paddr_t phys_top = 0;
+static struct spinlock buddy_lock = { 0 };
+
+/*
+ * Bootloader and ACPI reclaimable ranges (in frames),
+ * freed by vm_physseg_reclaim() once nothing refers
+ * to them anymore.
+ */
+static struct {
+    size_t start;
+    size_t end;
+} reclaim[VM_PHYSSEG_MAX];
+static size_t nreclaim = 0;
+
+/* Max translation tables kept alive across reclaim (2 pages) */
+#define RECLAIM_MAX_TABLES  ((2 * PAGE_SIZE) / sizeof(uintptr_t))
+
+/* The HHDM response lives in bootloader memory, keep a copy */
+static struct limine_hhdm_response hhdm_copy;
+
+/*
+ * Returns the segment containing
+ * `frame`, or NULL if there is none.
+ */
+static struct vm_physseg *
+vm_physseg_lookup(size_t frame)
+{
+    size_t lo, hi, mid;
+
+    lo = 0;
+    hi = nphysseg;
+
+    /* Segments are sorted, do a binary search */
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (frame < physseg[mid].start) {
+            hi = mid;
+        } else if (frame >= physseg[mid].end) {
+            lo = mid + 1;
+        } else {
+            return &physseg[mid];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Brings the summary levels up to date after
+ * word `w` of the map of `bo` has changed.
+ *
+ * Call with `buddy_lock` held.
+ */
 static void
-vm_physseg_bitmap_alloc(void)
+vm_buddy_summary_update(struct buddy_order *bo, size_t w)
+{
+    uint64_t *sw, old;
+    bool has_free;
+
+    has_free = ((uint64_t *)bo->map)[w] != BITMAP_WORD_FULL;
+
+    for (int level = 0; level < bo->nlevels; ++level) {
+        sw = &bo->summary[level][w / BITMAP_WORD_BITS];
+        old = *sw;
+
+        if (has_free) {
+            *sw |= __BIT(w % BITMAP_WORD_BITS);
+        } else {
+            *sw &= ~__BIT(w % BITMAP_WORD_BITS);
+        }
+
+        /* Upper levels only change when this word empties or fills */
+        if ((old != 0) == (*sw != 0)) {
+            return;
+        }
+
+        has_free = (*sw != 0);
+        w /= BITMAP_WORD_BITS;
+    }
+}
+
+/*
+ * Marks `count` blocks starting at `block`
+ * as in use.
+ *
+ * Call with `buddy_lock` held.
+ */
+static void
+vm_buddy_mark_used(struct buddy_order *bo, size_t block, size_t count)
+{
+    size_t first, last;
+
+    first = block / BITMAP_WORD_BITS;
+    last = (block + count - 1) / BITMAP_WORD_BITS;
+
+    bitmap_set_range(bo->map, block, count);
+    for (size_t w = first; w <= last; ++w) {
+        vm_buddy_summary_update(bo, w);
+    }
+}
+
+/*
+ * Marks `block` as the head of a free block.
+ *
+ * Call with `buddy_lock` held.
+ */
+static void
+vm_buddy_mark_free(struct buddy_order *bo, size_t block)
+{
+    bitmap_unset_bit(bo->map, block);
+    vm_buddy_summary_update(bo, block / BITMAP_WORD_BITS);
+}
+
+/*
+ * Finds a free block in the map of `bo` by walking
+ * down the summary levels.
+ *
+ * Returns the block, or VM_BUDDY_NONE if
+ * there are none.
+ *
+ * Call with `buddy_lock` held.
+ */
+static size_t
+vm_buddy_find_free(struct buddy_order *bo)
+{
+    const uint64_t *top;
+    size_t w, ntop;
+    int level;
+
+    level = bo->nlevels - 1;
+    top = bo->summary[level];
+    ntop = bo->summary_nwords[level];
+
+    /* The top level is at most a handful of words */
+    for (w = 0; w < ntop && top[w] == 0; ++w);
+    if (w == ntop) {
+        return VM_BUDDY_NONE;
+    }
+
+    w = w*BITMAP_WORD_BITS + __builtin_ctzll(top[w]);
+    while (--level >= 0) {
+        w = w*BITMAP_WORD_BITS + __builtin_ctzll(bo->summary[level][w]);
+    }
+
+    return w*BITMAP_WORD_BITS + __builtin_ctzll(~((uint64_t *)bo->map)[w]);
+}
+
+/*
+ * Finds `count` contiguous free blocks of `order` and
+ * takes them off the free map. Single blocks are found
+ * through the summary levels in O(log n), runs are
+ * searched for linearly from the next-fit hint,
+ * wrapping around to the start of the map.
+ *
+ * Returns the first block, or VM_BUDDY_NONE
+ * on failure.
+ *
+ * Call with `buddy_lock` held.
+ */
+static size_t
+vm_buddy_take(struct vm_physseg *seg, int order, size_t count)
+{
+    struct buddy_order *bo;
+    size_t block;
+
+    bo = &seg->buddy[order];
+    if (bo->nfree < count) {
+        return VM_BUDDY_NONE;
+    }
+
+    if (count == 1) {
+        block = vm_buddy_find_free(bo);
+    } else {
+        block = bitmap_find_zero_run(bo->map, bo->hint, bo->nblocks, count);
+        if (block == BITMAP_NONE && bo->hint > 0) {
+            block = bitmap_find_zero_run(bo->map, 0, bo->nblocks, count);
+        }
+        if (block != BITMAP_NONE) {
+            bo->hint = block + count;
+        }
+    }
+
+    if (block == VM_BUDDY_NONE) {
+        return VM_BUDDY_NONE;
+    }
+
+    vm_buddy_mark_used(bo, block, count);
+    bo->nfree -= count;
+    return block;
+}
+
+/*
+ * Frees a single block of `order`, merging it
+ * with its buddy for as long as the buddy is free.
+ *
+ * Call with `buddy_lock` held.
+ */
+static void
+vm_buddy_free_block(struct vm_physseg *seg, size_t block, int order)
+{
+    struct buddy_order *bo;
+    size_t buddy_block;
+
+    while (order < VM_BUDDY_MAX_ORDER) {
+        bo = &seg->buddy[order];
+        buddy_block = block ^ 1;
+
+        if (buddy_block >= bo->nblocks) {
+            break;
+        }
+        if (bitmap_test_bit(bo->map, buddy_block)) {
+            /* Buddy is in use, can't coalesce */
+            break;
+        }
+
+        /* Take the buddy off this order and go up one */
+        vm_buddy_mark_used(bo, buddy_block, 1);
+        --bo->nfree;
+        block >>= 1;
+        ++order;
+    }
+
+    bo = &seg->buddy[order];
+    vm_buddy_mark_free(bo, block);
+    ++bo->nfree;
+}
+
+/*
+ * Frees `count` frames starting at `frame` by splitting
+ * the range into the largest naturally aligned blocks.
+ *
+ * Call with `buddy_lock` held.
+ */
+static void
+vm_buddy_free_range(struct vm_physseg *seg, size_t frame, size_t count)
+{
+    size_t block;
+    int order;
+
+    block = frame - seg->base;
+    while (count > 0) {
+        order = VM_BUDDY_MAX_ORDER;
+        if (block != 0) {
+            order = __MIN(order, __builtin_ctzll(block));
+        }
+        while (__POW2(order) > count) {
+            --order;
+        }
+
+        vm_buddy_free_block(seg, block >> order, order);
+        block += __POW2(order);
+        count -= __POW2(order);
+    }
+}
+
+/*
+ * Allocates a single block of `order`, splitting
+ * a bigger block if there are no free blocks of
+ * `order` left. That's at most one summary walk
+ * per order, empty orders are skipped by `nfree`.
+ *
+ * Returns the block index, or VM_BUDDY_NONE
+ * on failure.
+ *
+ * Call with `buddy_lock` held.
+ */
+static size_t
+vm_buddy_alloc_block(struct vm_physseg *seg, int order)
+{
+    size_t block;
+    int o;
+
+    block = VM_BUDDY_NONE;
+    for (o = order; o <= VM_BUDDY_MAX_ORDER; ++o) {
+        if ((block = vm_buddy_take(seg, o, 1)) != VM_BUDDY_NONE) {
+            break;
+        }
+    }
+
+    if (block == VM_BUDDY_NONE) {
+        return VM_BUDDY_NONE;
+    }
+
+    /* Give back the upper half of each split */
+    while (o > order) {
+        --o;
+        block <<= 1;
+        vm_buddy_mark_free(&seg->buddy[o], block + 1);
+        ++seg->buddy[o].nfree;
+    }
+
+    return block;
+}
+
+/*
+ * Adds the usable range [`start`, `end`) (in frames)
+ * to the segment list, keeping it sorted and merging
+ * ranges that touch.
+ */
+static void
+vm_physseg_insert(size_t start, size_t end)
+{
+    struct vm_physseg *seg;
+    size_t i;
+
+    if (start >= end) {
+        return;
+    }
+
+    /* Find where it goes */
+    for (i = 0; i < nphysseg && physseg[i].start < start; ++i);
+
+    if (i > 0 && physseg[i - 1].end >= start) {
+        /* Touches the previous segment, grow that one */
+        seg = &physseg[--i];
+        seg->end = __MAX(seg->end, end);
+    } else {
+        if (nphysseg >= VM_PHYSSEG_MAX) {
+            DPRINTF("Out of segments, dropping 0x%x - 0x%x\n",
+                    start * PAGE_SIZE, end * PAGE_SIZE);
+            return;
+        }
+
+        memmove(&physseg[i + 1], &physseg[i],
+                (nphysseg - i) * sizeof(*seg));
+        ++nphysseg;
+
+        seg = &physseg[i];
+        memset(seg, 0, sizeof(*seg));
+        seg->start = start;
+        seg->end = end;
+    }
+
+    /* Swallow any segments that now touch this one */
+    while (i + 1 < nphysseg && physseg[i + 1].start <= seg->end) {
+        seg->end = __MAX(seg->end, physseg[i + 1].end);
+        memmove(&physseg[i + 1], &physseg[i + 2],
+                (nphysseg - i - 2) * sizeof(*seg));
+        --nphysseg;
+    }
+}
+
+/*
+ * Sizes the maps of `seg`.
+ *
+ * Returns the number of bytes needed
+ * for all of its maps.
+ */
+static size_t
+vm_physseg_size_maps(struct vm_physseg *seg)
+{
+    struct buddy_order *bo;
+    size_t nframes, nbits, size;
+
+    size = 0;
+    seg->base = __ALIGN_DOWN(seg->start, __POW2(VM_BUDDY_MAX_ORDER));
+    nframes = __ALIGN_UP(seg->end, __POW2(VM_BUDDY_MAX_ORDER)) - seg->base;
+
+    for (int order = 0; order <= VM_BUDDY_MAX_ORDER; ++order) {
+        bo = &seg->buddy[order];
+        bo->nblocks = nframes >> order;
+        bo->nwords = __DIV_ROUNDUP(bo->nblocks, BITMAP_WORD_BITS);
+        size += bo->nwords * sizeof(uint64_t);
+
+        /* Stack summary levels until the top one is a single word */
+        nbits = bo->nwords;
+        bo->nlevels = 0;
+        do {
+            bo->summary_nwords[bo->nlevels] = __DIV_ROUNDUP(nbits,
+                                                            BITMAP_WORD_BITS);
+            nbits = bo->summary_nwords[bo->nlevels++];
+            size += nbits * sizeof(uint64_t);
+        } while (nbits > 1 && bo->nlevels < VM_BUDDY_SUMMARY_MAX);
+    }
+
+    return size;
+}
+
+/*
+ * Returns the size of the page array of `seg`,
+ * rounded up to keep the next one aligned.
+ */
+static size_t
+vm_physseg_size_pages(struct vm_physseg *seg)
+{
+    size_t size;
+
+    size = (seg->end - seg->start) * sizeof(struct vm_page);
+    return __ALIGN_UP(size, 64);
+}
+
+/*
+ * Sets up the page array of `seg`, every
+ * frame starts out free.
+ */
+static void
+vm_physseg_init_pages(struct vm_physseg *seg)
+{
+    struct vm_page *pg;
+
+    memset(seg->pages, 0, vm_physseg_size_pages(seg));
+    for (size_t frame = seg->start; frame < seg->end; ++frame) {
+        pg = &seg->pages[frame - seg->start];
+        pg->phys = frame * PAGE_SIZE;
+    }
+
+    /* Flag memory the bootloader and firmware still use */
+    for (size_t i = 0; i < nreclaim; ++i) {
+        if (reclaim[i].start < seg->start || reclaim[i].end > seg->end) {
+            continue;
+        }
+
+        for (size_t frame = reclaim[i].start; frame < reclaim[i].end; ++frame) {
+            seg->pages[frame - seg->start].flags = VM_PAGE_BOOT;
+        }
+    }
+}
+
+/*
+ * Marks `count` frames starting at `phys`
+ * as allocated and wired for good.
+ */
+static void
+vm_physseg_wire(uintptr_t phys, size_t count)
+{
+    struct vm_page *pg;
+
+    for (size_t i = 0; i < count; ++i) {
+        if ((pg = vm_page_lookup(phys + i * PAGE_SIZE)) != NULL) {
+            pg->refcnt = 1;
+            pg->flags = VM_PAGE_WIRED;
+        }
+    }
+}
+
+/*
+ * Returns the number of free frames in `seg`,
+ * counted straight from its maps.
+ */
+__used static size_t
+vm_physseg_count_free(struct vm_physseg *seg)
+{
+    struct buddy_order *bo;
+    size_t nfree;
+
+    nfree = 0;
+    for (int order = 0; order <= VM_BUDDY_MAX_ORDER; ++order) {
+        bo = &seg->buddy[order];
+        nfree += (bo->nblocks - bitmap_popcount(bo->map, bo->nblocks))
+                 << order;
+    }
+
+    return nfree;
+}
+
+static void
+vm_physseg_bitmap_populate(void)
 {
     struct limine_memmap_entry *entry;
+    struct vm_physseg *seg;
+    size_t start, end;
+    paddr_t used_start, used_end;
+
+    /* What the boot arena handed out stays in use for good */
+    vm_bootmem_done(&used_start, &used_end);
+    vm_physseg_wire(used_start, (used_end - used_start) / PAGE_SIZE);
 
     for (size_t i = 0; i < resp->entry_count; ++i) {
         entry = resp->entries[i];
 
-        /* Drop any entries with an invalid type */
-        if (entry->type >= MAX_SEGMENTS) {
+        /* Don't set non-usable entries as free */
+        if (entry->type != LIMINE_MEMMAP_USABLE) {
             continue;
         }
 
-        if (entry->type != LIMINE_MEMMAP_USABLE) {
-            /* This memory is not usable */
+        start = __MAX(__DIV_ROUNDUP(entry->base, PAGE_SIZE), 1);
+        end = (entry->base + entry->length) / PAGE_SIZE;
+        if (start >= end || (seg = vm_physseg_lookup(start)) == NULL) {
             continue;
         }
 
-        if (entry->length >= bitmap_size) {
-            bitmap = PHYS_TO_VIRT(entry->base);
-            memset(bitmap, 0xFF, bitmap_size);
-            entry->length -= bitmap_size;
-            entry->base += bitmap_size;
-            return;
+        /* The arena is always at the front of its entry */
+        if (entry->base == used_start) {
+            start = __MAX(start, used_end / PAGE_SIZE);
+        }
+        if (start < end) {
+            vm_buddy_free_range(seg, start, end - start);
         }
     }
+
+    for (size_t i = 0; i < nphysseg; ++i) {
+        seg = &physseg[i];
+        DPRINTF("Segment 0x%x - 0x%x, %d free frames\n",
+                seg->start * PAGE_SIZE, seg->end * PAGE_SIZE,
+                vm_physseg_count_free(seg));
+    }
 }
 
 static void
-vm_physseg_bitmap_populate(void)
+vm_physseg_bitmap_init(void)
 {
     struct limine_memmap_entry *entry;
-#if defined(VM_PHYSSEG_DEBUG)
-    size_t start, end;
-#endif      /* defined(VM_PHYSSEG_DEBUG) */
+    struct buddy_order *bo;
+    size_t start, end, map_size, pages_size;
+    uint8_t *map;
 
     for (size_t i = 0; i < resp->entry_count; ++i) {
         entry = resp->entries[i];
@@ -116,66 +646,560 @@ vm_physseg_bitmap_populate(void)
             continue;
         }
 
-#if defined(VM_PHYSSEG_DEBUG)
         /* Dump the memory map if we are debugging */
-        start = entry->base;
-        end = entry->base + entry->length;
         DPRINTF("0x%x - 0x%x, size: 0x%x, type: %s\n",
-                start, end, entry->length,
-                segment_name[entry->type]);
-#endif  /* defined(VM_PHYSSEG_DEBUG) */
+                entry->base, entry->base + entry->length,
+                entry->length, segment_name[entry->type]);
 
-        /* Don't set non-usable entries as free */
-        if (entry->type != LIMINE_MEMMAP_USABLE) {
+        phys_top = __MAX(phys_top, entry->base + entry->length);
+
+        /*
+         * Frame 0 is never handed out as a
+         * zero address means failure.
+         */
+        start = __MAX(__DIV_ROUNDUP(entry->base, PAGE_SIZE), 1);
+        end = (entry->base + entry->length) / PAGE_SIZE;
+
+        switch (entry->type) {
+        case LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE:
+        case LIMINE_MEMMAP_ACPI_RECLAIMABLE:
+            /*
+             * Still in use, but covered by the maps so
+             * vm_physseg_reclaim() can free it later.
+             */
+            if (start < end && nreclaim < VM_PHYSSEG_MAX) {
+                reclaim[nreclaim].start = start;
+                reclaim[nreclaim].end = end;
+                ++nreclaim;
+                vm_physseg_insert(start, end);
+            }
+            break;
+        case LIMINE_MEMMAP_USABLE:
+            vm_physseg_insert(start, end);
+            break;
+        }
+    }
+
+    /*
+     * Size the page arrays and maps over the full
+     * segments, then get them from the boot arena.
+     */
+    pages_size = 0;
+    map_size = 0;
+    for (size_t i = 0; i < nphysseg; ++i) {
+        pages_size += vm_physseg_size_pages(&physseg[i]);
+        map_size += vm_physseg_size_maps(&physseg[i]);
+    }
+
+    DPRINTF("Page arrays size: %d bytes\n", pages_size);
+    DPRINTF("Buddy maps size: %d bytes\n", map_size);
+    DPRINTF("Allocating and populating buddy maps now...\n");
+
+    map = vm_bootmem_alloc(pages_size + map_size, 64);
+    if (map == NULL) {
+        nphysseg = 0;
+        return;
+    }
+
+    for (size_t i = 0; i < nphysseg; ++i) {
+        physseg[i].pages = (struct vm_page *)map;
+        map += vm_physseg_size_pages(&physseg[i]);
+        vm_physseg_init_pages(&physseg[i]);
+    }
+
+    /*
+     * Everything starts out in use with nothing free
+     * in the summaries; populating fills both in.
+     */
+    memset(map, 0xFF, map_size);
+    for (size_t i = 0; i < nphysseg; ++i) {
+        for (int order = 0; order <= VM_BUDDY_MAX_ORDER; ++order) {
+            bo = &physseg[i].buddy[order];
+            bo->map = map;
+            map += bo->nwords * sizeof(uint64_t);
+
+            for (int level = 0; level < bo->nlevels; ++level) {
+                bo->summary[level] = (uint64_t *)map;
+                memset(map, 0, bo->summary_nwords[level] * sizeof(uint64_t));
+                map += bo->summary_nwords[level] * sizeof(uint64_t);
+            }
+        }
+    }
+
+    vm_physseg_bitmap_populate();
+}
+
+/*
+ * Resets the pages of `count` frames starting
+ * at `phys` to hold `refcnt` references.
+ */
+static void
+vm_physseg_set_pages(uintptr_t phys, size_t count, uint32_t refcnt)
+{
+    struct vm_physseg *seg;
+    struct vm_page *pg;
+
+    seg = vm_physseg_lookup(phys / PAGE_SIZE);
+    pg = &seg->pages[phys / PAGE_SIZE - seg->start];
+    for (size_t i = 0; i < count; ++i, ++pg) {
+        pg->refcnt = refcnt;
+        pg->flags = 0;
+    }
+}
+
+/*
+ * Allocates `count` frames for vm_alloc_pageframe(),
+ * contents are left as is.
+ */
+static uintptr_t
+vm_physseg_alloc(size_t count)
+{
+    struct vm_physseg *seg;
+    size_t block, frame, nframes;
+    int order;
+
+    if (count == 0 || nphysseg == 0) {
+        return 0;
+    }
+
+    /* Single frames come from the per-processor magazines */
+    if (count == 1) {
+        return vm_pagemag_alloc();
+    }
+
+    order = 0;
+    while (order < VM_BUDDY_MAX_ORDER && __POW2(order) < count) {
+        ++order;
+    }
+
+    nframes = __POW2(order);
+    if (nframes < count) {
+        /* Too big for one block, look for adjacent ones */
+        nframes = __ALIGN_UP(count, __POW2(VM_BUDDY_MAX_ORDER));
+    }
+
+    block = VM_BUDDY_NONE;
+    spinlock_acquire(&buddy_lock);
+    for (size_t i = 0; i < nphysseg && block == VM_BUDDY_NONE; ++i) {
+        seg = &physseg[i];
+        if (nframes == __POW2(order)) {
+            block = vm_buddy_alloc_block(seg, order);
+        } else {
+            block = vm_buddy_take(seg, order, nframes >> order);
+        }
+    }
+
+    if (block == VM_BUDDY_NONE) {
+        spinlock_release(&buddy_lock);
+        return 0;
+    }
+
+    frame = seg->base + (block << order);
+    if (nframes > count) {
+        vm_buddy_free_range(seg, frame + count, nframes - count);
+    }
+
+    spinlock_release(&buddy_lock);
+    return frame * PAGE_SIZE;
+}
+
+/*
+ * Allocates `count` physically contiguous
+ * page frames.
+ *
+ * The run is aligned to the smallest power of two
+ * that is not less than `count` (up to a 2 MiB
+ * boundary), frames past `count` are given back
+ * right away.
+ *
+ * With VM_ALLOC_ZERO the frames are returned zeroed,
+ * single frames come out of the zero pool if it has
+ * any.
+ *
+ * If we are out, the frames held in the magazines
+ * and on the color queues are given back to coalesce
+ * and we try once more, unless VM_ALLOC_NODRAIN is
+ * passed.
+ *
+ * Returns the physical address of the first
+ * frame, or 0 on failure.
+ */
+uintptr_t
+vm_alloc_pageframe(size_t count, int flags)
+{
+    uintptr_t phys;
+
+    if (__TEST(flags, VM_ALLOC_ZERO) && count == 1) {
+        if ((phys = vm_zeropool_take()) != 0) {
+            return phys;
+        }
+    }
+
+    if ((phys = vm_physseg_alloc(count)) == 0) {
+        /* Try again with what the magazines and color queues hold */
+        if (__TEST(flags, VM_ALLOC_NODRAIN)) {
+            return 0;
+        }
+        if (vm_pagemag_drain() + vm_pagecolor_drain() == 0) {
+            return 0;
+        }
+        if ((phys = vm_physseg_alloc(count)) == 0) {
+            return 0;
+        }
+    }
+
+    vm_physseg_set_pages(phys, count, 1);
+
+    if (__TEST(flags, VM_ALLOC_ZERO)) {
+        memset(PHYS_TO_VIRT(phys), 0, count * PAGE_SIZE);
+    }
+
+    return phys;
+}
+
+/*
+ * Frees `count` page frames starting at
+ * the physical address `phys`.
+ */
+void
+vm_free_pageframe(uintptr_t phys, size_t count)
+{
+    struct vm_physseg *seg;
+    size_t frame;
+
+    frame = phys / PAGE_SIZE;
+
+    /* Don't touch anything outside of the segments */
+    seg = vm_physseg_lookup(frame);
+    if (seg == NULL || frame + count > seg->end) {
+        return;
+    }
+
+    vm_physseg_set_pages(phys, count, 0);
+    if (count == 1) {
+        vm_pagemag_free(phys);
+        return;
+    }
+
+    spinlock_acquire(&buddy_lock);
+    vm_buddy_free_range(seg, frame, count);
+    spinlock_release(&buddy_lock);
+}
+
+/*
+ * Allocates up to `count` single frames into `frames`
+ * while only taking the buddy lock once. Used to refill
+ * the per-processor magazines.
+ *
+ * Returns the number of frames allocated.
+ */
+size_t
+vm_physseg_alloc_batch(uintptr_t *frames, size_t count)
+{
+    struct vm_physseg *seg;
+    size_t block, i, segno;
+
+    i = 0;
+    segno = 0;
+
+    spinlock_acquire(&buddy_lock);
+    while (i < count && segno < nphysseg) {
+        seg = &physseg[segno];
+        if ((block = vm_buddy_alloc_block(seg, 0)) == VM_BUDDY_NONE) {
+            /* This one is out of frames, try the next one */
+            ++segno;
+            continue;
+        }
+        frames[i++] = (seg->base + block) * PAGE_SIZE;
+    }
+
+    spinlock_release(&buddy_lock);
+    return i;
+}
+
+/*
+ * Frees `count` single frames from `frames` while
+ * only taking the buddy lock once. Used to drain
+ * the per-processor magazines.
+ */
+void
+vm_physseg_free_batch(const uintptr_t *frames, size_t count)
+{
+    struct vm_physseg *seg;
+    size_t frame;
+
+    spinlock_acquire(&buddy_lock);
+    for (size_t i = 0; i < count; ++i) {
+        frame = frames[i] / PAGE_SIZE;
+        if ((seg = vm_physseg_lookup(frame)) != NULL) {
+            vm_buddy_free_block(seg, frame - seg->base, 0);
+        }
+    }
+    spinlock_release(&buddy_lock);
+}
+
+/*
+ * Returns the page describing the frame at
+ * `phys`, or NULL if it isn't within any of
+ * the physical segments.
+ */
+struct vm_page *
+vm_page_lookup(uintptr_t phys)
+{
+    struct vm_physseg *seg;
+    size_t frame;
+
+    frame = phys / PAGE_SIZE;
+    if ((seg = vm_physseg_lookup(frame)) == NULL) {
+        return NULL;
+    }
+
+    return &seg->pages[frame - seg->start];
+}
+
+/*
+ * Drops a reference on a frame, the
+ * last one frees it.
+ */
+void
+vm_page_unref(struct vm_page *pg)
+{
+    if (__atomic_sub_fetch(&pg->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        vm_free_pageframe(pg->phys, 1);
+    }
+}
+
+/*
+ * Gives bootloader and ACPI reclaimable memory back
+ * to the allocator. The translation tables we are
+ * running on are left alone.
+ *
+ * => Limine responses (other than the memory map and
+ *    HHDM responses), ACPI tables and the boot stack
+ *    must no longer be referenced.
+ */
+void
+vm_physseg_reclaim(void)
+{
+    struct vm_physseg *seg;
+    uintptr_t *tables, tables_phys;
+    size_t ntables, frame, nreclaimed;
+
+    if (nreclaim == 0) {
+        return;
+    }
+
+    hhdm_copy = *g_hhdm_request.response;
+    g_hhdm_request.response = &hhdm_copy;
+
+    tables_phys = vm_alloc_pageframe(2, 0);
+    if (tables_phys == 0) {
+        return;
+    }
+
+    tables = PHYS_TO_VIRT(tables_phys);
+    ntables = processor_pagetables(tables, RECLAIM_MAX_TABLES);
+    if (ntables > RECLAIM_MAX_TABLES) {
+        KINFO("Too many translation tables, not reclaiming\n");
+        vm_free_pageframe(tables_phys, 2);
+        return;
+    }
+
+    /* Sort the tables so each range is walked once */
+    for (size_t i = 1; i < ntables; ++i) {
+        for (size_t j = i; j > 0 && tables[j - 1] > tables[j]; --j) {
+            frame = tables[j];
+            tables[j] = tables[j - 1];
+            tables[j - 1] = frame;
+        }
+    }
+
+    nreclaimed = 0;
+    spinlock_acquire(&buddy_lock);
+    for (size_t i = 0; i < nreclaim; ++i) {
+        if ((seg = vm_physseg_lookup(reclaim[i].start)) == NULL) {
             continue;
         }
 
-        /* Populate */
-        if (bitmap_free_start == 0) {
-            bitmap_free_start = entry->base/0x1000;
+        for (frame = reclaim[i].start; frame < reclaim[i].end; ++frame) {
+            seg->pages[frame - seg->start].flags = 0;
         }
-        for (size_t j = 0; j < entry->length; j += 0x1000) {
-            bitmap_unset_bit(bitmap, (entry->base + j) / 0x1000);
+
+        /* Free everything around the tables */
+        frame = reclaim[i].start;
+        for (size_t j = 0; j < ntables; ++j) {
+            if (tables[j] / PAGE_SIZE < frame) {
+                continue;
+            }
+            if (tables[j] / PAGE_SIZE >= reclaim[i].end) {
+                break;
+            }
+
+            vm_buddy_free_range(seg, frame, tables[j] / PAGE_SIZE - frame);
+            nreclaimed += tables[j] / PAGE_SIZE - frame;
+            frame = tables[j] / PAGE_SIZE + 1;
         }
+
+        vm_buddy_free_range(seg, frame, reclaim[i].end - frame);
+        nreclaimed += reclaim[i].end - frame;
+    }
+
+    nreclaim = 0;
+    spinlock_release(&buddy_lock);
+
+    /* The tables stay in use by the processor */
+    for (size_t i = 0; i < ntables; ++i) {
+        vm_physseg_wire(tables[i], 1);
     }
+
+    vm_free_pageframe(tables_phys, 2);
+    KINFO("Reclaimed %d KiB of boot memory\n",
+          nreclaimed * (PAGE_SIZE / 1024));
 }
 
+/*
+ * Returns the end of the highest memory
+ * map entry, whatever its type.
+ */
+paddr_t
+vm_physseg_top(void)
+{
+    return phys_top;
+}
+
+#if defined(VM_PHYSSEG_SELFTEST)
+/* Runs live at once and allocations made by the self-test */
+#define SELFTEST_SLOTS      64
+#define SELFTEST_ROUNDS     4096
+
+/*
+ * Fills `counts` with the number of free blocks
+ * of each order, over every segment.
+ */
 static void
-vm_physseg_bitmap_init(void)
+vm_physseg_count_orders(size_t counts[VM_BUDDY_MAX_ORDER + 1])
 {
-    uintptr_t highest_addr;
-    size_t highest_page_idx;
-    struct limine_memmap_entry *entry;
+    spinlock_acquire(&buddy_lock);
+    for (int order = 0; order <= VM_BUDDY_MAX_ORDER; ++order) {
+        counts[order] = 0;
+        for (size_t i = 0; i < nphysseg; ++i) {
+            counts[order] += physseg[i].buddy[order].nfree;
+        }
+    }
+    spinlock_release(&buddy_lock);
+}
 
-    highest_addr = 0;
-    highest_page_idx = 0;
+/*
+ * Allocates and frees runs of random sizes, from
+ * single frames up past VM_BUDDY_MAX_ORDER. Every
+ * run has to be aligned and clear of the others
+ * live, and once all are freed the buddies have to
+ * coalesce back into exactly the blocks we started
+ * with. Panics if not, reports cycles per op if so.
+ *
+ * => Call before anything else on this processor
+ *    allocates frames, with no other processors up.
+ */
+void
+vm_physseg_selftest(void)
+{
+    static struct {
+        uintptr_t phys;
+        size_t count;
+    } slot[SELFTEST_SLOTS];
+    size_t before[VM_BUDDY_MAX_ORDER + 1], after[VM_BUDDY_MAX_ORDER + 1];
+    size_t i, nalloc, nfree, align;
+    uint64_t seed, start, alloc_cycles, free_cycles;
+    uintptr_t phys, end;
 
-    /* Find the highest entry */
-    for (size_t i = 0; i < resp->entry_count; ++i) {
-        entry = resp->entries[i];
+    /* Start from fully coalesced blocks */
+    vm_pagemag_drain();
+    vm_physseg_count_orders(before);
 
-        if (entry->type != LIMINE_MEMMAP_USABLE) {
-            /* Memeory not usable */
+    seed = 0x9E3779B97F4A7C15;
+    nalloc = nfree = 0;
+    alloc_cycles = free_cycles = 0;
+
+    for (size_t round = 0; round < SELFTEST_ROUNDS; ++round) {
+        /* xorshift64 */
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+
+        i = seed % SELFTEST_SLOTS;
+        if (slot[i].count != 0) {
+            start = rdtsc();
+            vm_free_pageframe(slot[i].phys, slot[i].count);
+            free_cycles += rdtsc() - start;
+            ++nfree;
+            slot[i].count = 0;
+            continue;
+        }
+
+        /* Mostly small runs, now and then a big one */
+        slot[i].count = 1 + (seed >> 8) % __POW2((seed >> 32) % 11);
+        start = rdtsc();
+        phys = vm_alloc_pageframe(slot[i].count, VM_ALLOC_NODRAIN);
+        alloc_cycles += rdtsc() - start;
+        ++nalloc;
+
+        if (phys == 0) {
+            slot[i].count = 0;
             continue;
         }
 
-        highest_addr = __MAX(highest_addr, entry->base + entry->length);
+        align = 1;
+        while (align < slot[i].count && align < __POW2(VM_BUDDY_MAX_ORDER)) {
+            align <<= 1;
+        }
+        if ((phys / PAGE_SIZE) % align != 0) {
+            panic("Self-test run at 0x%x is misaligned\n", phys);
+        }
+
+        end = phys + slot[i].count * PAGE_SIZE;
+        for (size_t j = 0; j < SELFTEST_SLOTS; ++j) {
+            if (j == i || slot[j].count == 0) {
+                continue;
+            }
+            if (phys < slot[j].phys + slot[j].count * PAGE_SIZE &&
+                slot[j].phys < end) {
+                panic("Self-test runs at 0x%x and 0x%x overlap\n",
+                      phys, slot[j].phys);
+            }
+        }
+        slot[i].phys = phys;
     }
 
-    highest_page_idx = highest_addr / 0x1000;
-    bitmap_size = __ALIGN_UP(highest_page_idx / 8, 0x1000);
+    for (i = 0; i < SELFTEST_SLOTS; ++i) {
+        if (slot[i].count != 0) {
+            vm_free_pageframe(slot[i].phys, slot[i].count);
+            slot[i].count = 0;
+        }
+    }
 
-    DPRINTF("Bitmap size: %d bytes\n", bitmap_size);
-    DPRINTF("Allocating and populating bitmap now...\n");
+    vm_pagemag_drain();
+    vm_physseg_count_orders(after);
+    for (int order = 0; order <= VM_BUDDY_MAX_ORDER; ++order) {
+        if (before[order] != after[order]) {
+            panic("Self-test left %d free blocks of order %d, not %d\n",
+                  after[order], order, before[order]);
+        }
+    }
 
-    vm_physseg_bitmap_alloc();
-    vm_physseg_bitmap_populate();
+    KINFO("self-test passed: %d allocs, %d cycles/op; %d frees, %d cycles/op\n",
+          nalloc, alloc_cycles / __MAX(nalloc, 1),
+          nfree, free_cycles / __MAX(nfree, 1));
 }
+#endif      /* defined(VM_PHYSSEG_SELFTEST) */
 
 void
 vm_physseg_init(void)
 {
     resp = mmap_req.response;
 
+    vm_bootmem_init(resp);
     vm_physseg_bitmap_init();
+
+    /* The memory map is reclaimable, don't use it past here */
+    resp = NULL;
 }
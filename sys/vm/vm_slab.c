@@ -0,0 +1,589 @@
+/*
+ * Copyright (c) 2023 Ian Marco Moffett and the VegaOS team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of VegaOS nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#include <sys/cdefs.h>
+#include <sys/syslog.h>
+#include <sys/errno.h>
+#include <sys/panic.h>
+#include <sys/machdep.h>
+#include <vm/vm_slab.h>
+#include <vm/vm_physseg.h>
+#include <vm/vm_page.h>
+#include <vm/vm.h>
+#include <string.h>
+
+__MODULE_NAME("vm_slab");
+__KERNEL_META("$Vega$: vm_slab.c, Ian Marco Moffett, "
+              "Slab allocator and kmalloc()");
+
+#if defined(VM_SLAB_DEBUG)
+#define DPRINTF(...) KDEBUG(__VA_ARGS__)
+#else
+#define DPRINTF(...) __nothing
+#endif      /* defined(VM_SLAB_DEBUG) */
+
+/* Smallest kmalloc() size, and alignment of everything it returns */
+#define KMALLOC_MIN         16
+#define KMALLOC_NCACHES     8           /* 16 .. VM_KMALLOC_MAX */
+
+/*
+ * A slab is 2^order pages: this header, the stack of
+ * free object indices, the color offset and then
+ * the objects themselves.
+ */
+struct vm_slab {
+    TAILQ_ENTRY(vm_slab) link;
+    struct vm_slab_cache *cache;
+    uint8_t *objs;              /* First object */
+    size_t nfree;
+    uint16_t freelist[];        /* Free object indices, `nfree` deep */
+};
+
+static TAILQ_HEAD(, vm_slab_cache) cache_list;
+static struct spinlock cache_list_lock = { 0 };
+
+/* The caches `struct vm_slab_cache`s and magazines come from */
+static struct vm_slab_cache cache_cache;
+static struct vm_slab_cache mag_cache;
+
+static struct vm_slab_cache *kmalloc_caches[KMALLOC_NCACHES];
+
+/*
+ * Works out the slab geometry of `cache` for
+ * 2^`order` page slabs.
+ *
+ * Returns the bytes of each slab left unused.
+ */
+static size_t
+vm_slab_geometry(struct vm_slab_cache *cache, int order)
+{
+    size_t slab_size, n;
+
+    slab_size = PAGE_SIZE << order;
+    n = (slab_size - sizeof(struct vm_slab)) /
+        (cache->objsize + sizeof(uint16_t));
+
+    /* The header is padded out to the object alignment */
+    for (; n > 0; --n) {
+        cache->hdrsize = __ALIGN_UP(sizeof(struct vm_slab) +
+                                    n * sizeof(uint16_t), cache->align);
+        if (cache->hdrsize + n * cache->objsize <= slab_size) {
+            break;
+        }
+    }
+
+    cache->order = order;
+    cache->nobjs = n;
+    if (n == 0) {
+        return slab_size;
+    }
+
+    return slab_size - cache->hdrsize - n * cache->objsize;
+}
+
+/*
+ * Sets up `cache` to hand out `size` byte objects
+ * aligned to `align`, with `magsize` round magazines
+ * in front of it (0 for none).
+ *
+ * Returns 0 on success, EXIT_FAILURE if an object
+ * doesn't fit within the largest slab.
+ */
+static int
+vm_slab_cache_setup(struct vm_slab_cache *cache, const char *name,
+                    size_t size, size_t align, void(*ctor)(void *obj),
+                    size_t magsize)
+{
+    size_t waste, i;
+
+    if (align == 0) {
+        align = sizeof(void *);
+    }
+
+    for (i = 0; i < VM_SLAB_NAMELEN - 1 && name[i] != '\0'; ++i) {
+        cache->name[i] = name[i];
+    }
+    cache->name[i] = '\0';
+
+    cache->reqsize = size;
+    cache->align = align;
+    cache->objsize = __ALIGN_UP(__MAX(size, 1), align);
+    cache->ctor = ctor;
+
+    /* Go for the smallest slab that wastes at most an eighth */
+    waste = 0;
+    for (int order = 0; order <= VM_SLAB_MAX_ORDER; ++order) {
+        waste = vm_slab_geometry(cache, order);
+        if (cache->nobjs > 0 && waste <= (PAGE_SIZE << order) / 8) {
+            break;
+        }
+    }
+
+    if (cache->nobjs == 0) {
+        return EXIT_FAILURE;
+    }
+
+    /* Spread the first object of each slab over the unused space */
+    cache->ncolors = waste / align + 1;
+    cache->color_next = 0;
+
+    TAILQ_INIT(&cache->full);
+    TAILQ_INIT(&cache->partial);
+    TAILQ_INIT(&cache->empty);
+    cache->nslabs = 0;
+    cache->nactive = 0;
+    cache->lock = (struct spinlock) { 0 };
+
+    cache->magsize = magsize;
+    cache->contention = 0;
+    TAILQ_INIT(&cache->depot_full);
+    TAILQ_INIT(&cache->depot_empty);
+    cache->depot_nfull = 0;
+    cache->depot_lock = (struct spinlock) { 0 };
+    memset(cache->cpu, 0, sizeof(cache->cpu));
+
+    spinlock_acquire(&cache_list_lock);
+    TAILQ_INSERT_TAIL(&cache_list, cache, link);
+    spinlock_release(&cache_list_lock);
+
+    DPRINTF("%s: %d byte objects, %d per %d page slab, %d colors\n",
+            cache->name, cache->objsize, cache->nobjs,
+            __POW2(cache->order), cache->ncolors);
+    return 0;
+}
+
+/*
+ * Makes a new slab for `cache`, constructing
+ * all of its objects.
+ *
+ * Returns NULL if we are out of memory.
+ *
+ * => Call with the lock of `cache` held.
+ */
+static struct vm_slab *
+vm_slab_create(struct vm_slab_cache *cache)
+{
+    struct vm_slab *slab;
+    struct vm_page *pg;
+    uintptr_t phys;
+    size_t npages;
+
+    npages = __POW2(cache->order);
+    if ((phys = vm_alloc_pageframe(npages, 0)) == 0) {
+        return NULL;
+    }
+
+    /* kfree() gets back to the slab through the pages */
+    for (size_t i = 0; i < npages; ++i) {
+        pg = vm_page_lookup(phys + i * PAGE_SIZE);
+        pg->flags |= VM_PAGE_SLAB;
+        pg->slab = PHYS_TO_VIRT(phys);
+    }
+
+    slab = PHYS_TO_VIRT(phys);
+    slab->cache = cache;
+    slab->objs = (uint8_t *)slab + cache->hdrsize +
+                 cache->color_next * cache->align;
+    slab->nfree = cache->nobjs;
+
+    if (++cache->color_next == cache->ncolors) {
+        cache->color_next = 0;
+    }
+
+    for (size_t i = 0; i < cache->nobjs; ++i) {
+        /* Hand out the lowest addresses first */
+        slab->freelist[i] = cache->nobjs - i - 1;
+        if (cache->ctor != NULL) {
+            cache->ctor(slab->objs + i * cache->objsize);
+        }
+    }
+
+    ++cache->nslabs;
+    return slab;
+}
+
+/*
+ * Gives the pages of `slab` back.
+ *
+ * => Call with the lock of its cache held.
+ */
+static void
+vm_slab_destroy(struct vm_slab *slab)
+{
+    struct vm_slab_cache *cache = slab->cache;
+
+    --cache->nslabs;
+    vm_free_pageframe(VIRT_TO_PHYS(slab), __POW2(cache->order));
+}
+
+/*
+ * Creates a cache named `name` of `size` byte objects
+ * aligned to `align` (0 for pointer alignment).
+ * `ctor`, if not NULL, is run on each object once.
+ *
+ * Returns NULL on failure.
+ */
+struct vm_slab_cache *
+vm_slab_cache_create(const char *name, size_t size, size_t align,
+                     void(*ctor)(void *obj))
+{
+    struct vm_slab_cache *cache;
+
+    if ((cache = vm_slab_alloc(&cache_cache)) == NULL) {
+        return NULL;
+    }
+
+    if (vm_slab_cache_setup(cache, name, size, align, ctor,
+                            VM_SLAB_MAG_MIN) != 0) {
+        vm_slab_free(&cache_cache, cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+/*
+ * Allocates an object straight from
+ * the slabs of `cache`.
+ *
+ * Returns NULL if we are out of memory.
+ */
+static void *
+vm_slab_alloc_slab(struct vm_slab_cache *cache)
+{
+    struct vm_slab *slab;
+    void *obj;
+
+    spinlock_acquire(&cache->lock);
+    if ((slab = TAILQ_FIRST(&cache->partial)) != NULL) {
+        TAILQ_REMOVE(&cache->partial, slab, link);
+    } else if ((slab = TAILQ_FIRST(&cache->empty)) != NULL) {
+        TAILQ_REMOVE(&cache->empty, slab, link);
+    } else if ((slab = vm_slab_create(cache)) == NULL) {
+        spinlock_release(&cache->lock);
+        return NULL;
+    }
+
+    obj = slab->objs + slab->freelist[--slab->nfree] * cache->objsize;
+    if (slab->nfree == 0) {
+        TAILQ_INSERT_HEAD(&cache->full, slab, link);
+    } else {
+        TAILQ_INSERT_HEAD(&cache->partial, slab, link);
+    }
+
+    ++cache->nactive;
+    spinlock_release(&cache->lock);
+    return obj;
+}
+
+/*
+ * Returns `obj` straight to the
+ * slab it came from.
+ */
+static void
+vm_slab_free_slab(struct vm_slab_cache *cache, void *obj)
+{
+    struct vm_slab *slab;
+    struct vm_page *pg;
+
+    pg = vm_page_lookup(VIRT_TO_PHYS(obj));
+    slab = pg->slab;
+
+    spinlock_acquire(&cache->lock);
+    if (slab->nfree == 0) {
+        TAILQ_REMOVE(&cache->full, slab, link);
+    } else {
+        TAILQ_REMOVE(&cache->partial, slab, link);
+    }
+
+    slab->freelist[slab->nfree++] = ((uint8_t *)obj - slab->objs) /
+                                    cache->objsize;
+    --cache->nactive;
+
+    if (slab->nfree < cache->nobjs) {
+        TAILQ_INSERT_HEAD(&cache->partial, slab, link);
+    } else if (TAILQ_EMPTY(&cache->empty)) {
+        /* Keep one empty slab around to avoid thrashing */
+        TAILQ_INSERT_HEAD(&cache->empty, slab, link);
+    } else {
+        vm_slab_destroy(slab);
+    }
+
+    spinlock_release(&cache->lock);
+}
+
+/*
+ * Takes the depot lock of `cache`, growing the
+ * magazines if it keeps being fought over.
+ */
+static void
+vm_slab_depot_lock(struct vm_slab_cache *cache)
+{
+    bool contended = false;
+
+    while (!spinlock_try_acquire(&cache->depot_lock)) {
+        contended = true;
+    }
+
+    if (!contended) {
+        return;
+    }
+
+    /*
+     * Bigger magazines mean fewer trips to the depot,
+     * magazines already around simply fill up further.
+     */
+    if (++cache->contention >= VM_SLAB_MAG_CONTENTION &&
+        cache->magsize < VM_SLAB_MAG_MAX) {
+        cache->magsize = __MIN(cache->magsize * 2, VM_SLAB_MAG_MAX);
+        cache->contention = 0;
+        DPRINTF("%s: magazines grown to %d rounds\n", cache->name,
+                cache->magsize);
+    }
+}
+
+/*
+ * Allocates an object from `cache`.
+ *
+ * The magazines of the current processor are tried
+ * first, then the depot and finally the slabs.
+ *
+ * Returns NULL if we are out of memory.
+ */
+void *
+vm_slab_alloc(struct vm_slab_cache *cache)
+{
+    struct vm_slab_cpu *cc;
+    struct vm_slab_mag *mag;
+
+    if (cache->magsize == 0) {
+        return vm_slab_alloc_slab(cache);
+    }
+
+    cc = &cache->cpu[this_processor()->id];
+    if (cc->loaded != NULL && cc->loaded->rounds > 0) {
+        return cc->loaded->objs[--cc->loaded->rounds];
+    }
+
+    if (cc->prev != NULL && cc->prev->rounds > 0) {
+        mag = cc->loaded;
+        cc->loaded = cc->prev;
+        cc->prev = mag;
+        return cc->loaded->objs[--cc->loaded->rounds];
+    }
+
+    /* Both are empty, trade one in for a full one */
+    vm_slab_depot_lock(cache);
+    if ((mag = TAILQ_FIRST(&cache->depot_full)) != NULL) {
+        TAILQ_REMOVE(&cache->depot_full, mag, link);
+        --cache->depot_nfull;
+        if (cc->prev != NULL) {
+            TAILQ_INSERT_HEAD(&cache->depot_empty, cc->prev, link);
+        }
+
+        cc->prev = cc->loaded;
+        cc->loaded = mag;
+        spinlock_release(&cache->depot_lock);
+        return mag->objs[--mag->rounds];
+    }
+
+    spinlock_release(&cache->depot_lock);
+    return vm_slab_alloc_slab(cache);
+}
+
+/*
+ * Returns `obj` to `cache`, in its
+ * constructed state.
+ */
+void
+vm_slab_free(struct vm_slab_cache *cache, void *obj)
+{
+    struct vm_slab_cpu *cc;
+    struct vm_slab_mag *mag;
+
+    if (cache->magsize == 0) {
+        vm_slab_free_slab(cache, obj);
+        return;
+    }
+
+    cc = &cache->cpu[this_processor()->id];
+    if (cc->loaded != NULL && cc->loaded->rounds < cache->magsize) {
+        cc->loaded->objs[cc->loaded->rounds++] = obj;
+        return;
+    }
+
+    if (cc->prev != NULL && cc->prev->rounds == 0) {
+        mag = cc->loaded;
+        cc->loaded = cc->prev;
+        cc->prev = mag;
+        cc->loaded->objs[cc->loaded->rounds++] = obj;
+        return;
+    }
+
+    /* Both are full, trade `prev` in for an empty one */
+    vm_slab_depot_lock(cache);
+    mag = cc->prev;
+    if (mag != NULL && cache->depot_nfull < VM_SLAB_DEPOT_MAX) {
+        TAILQ_INSERT_HEAD(&cache->depot_full, mag, link);
+        ++cache->depot_nfull;
+        cc->prev = NULL;
+        mag = NULL;
+    }
+    if (mag == NULL && (mag = TAILQ_FIRST(&cache->depot_empty)) != NULL) {
+        TAILQ_REMOVE(&cache->depot_empty, mag, link);
+    }
+    spinlock_release(&cache->depot_lock);
+
+    if (mag == cc->prev && mag != NULL) {
+        /* The depot has plenty, give these back to the slabs */
+        for (size_t i = 0; i < mag->rounds; ++i) {
+            vm_slab_free_slab(cache, mag->objs[i]);
+        }
+    } else if (mag == NULL && (mag = vm_slab_alloc(&mag_cache)) == NULL) {
+        vm_slab_free_slab(cache, obj);
+        return;
+    }
+
+    mag->rounds = 0;
+    cc->prev = cc->loaded;
+    cc->loaded = mag;
+    mag->objs[mag->rounds++] = obj;
+}
+
+/*
+ * Fetches statistics for `cache`.
+ */
+void
+vm_slab_stats(struct vm_slab_cache *cache, struct vm_slab_stats *res)
+{
+    size_t slab_size;
+
+    slab_size = PAGE_SIZE << cache->order;
+
+    spinlock_acquire(&cache->lock);
+    res->active = cache->nactive;
+    res->total = cache->nslabs * cache->nobjs;
+    res->slabs = cache->nslabs;
+    res->waste = cache->nslabs * (slab_size - cache->nobjs * cache->objsize) +
+                 res->total * (cache->objsize - cache->reqsize);
+    res->magsize = cache->magsize;
+    spinlock_release(&cache->lock);
+}
+
+/*
+ * Allocates `size` bytes of kernel memory,
+ * aligned to at least 16 bytes.
+ *
+ * Returns NULL on failure.
+ */
+void *
+kmalloc(size_t size)
+{
+    struct vm_page *pg;
+    uintptr_t phys;
+    size_t npages;
+    int idx;
+
+    if (size == 0) {
+        return NULL;
+    }
+
+    if (size <= VM_KMALLOC_MAX) {
+        idx = 0;
+        while ((size_t)(KMALLOC_MIN << idx) < size) {
+            ++idx;
+        }
+
+        return vm_slab_alloc(kmalloc_caches[idx]);
+    }
+
+    /* Too big for the caches, go to the page allocator */
+    npages = __DIV_ROUNDUP(size, PAGE_SIZE);
+    if ((phys = vm_alloc_pageframe(npages, 0)) == 0) {
+        return NULL;
+    }
+
+    pg = vm_page_lookup(phys);
+    pg->flags |= VM_PAGE_LARGE;
+    pg->npages = npages;
+    return PHYS_TO_VIRT(phys);
+}
+
+/*
+ * Frees memory from kmalloc().
+ */
+void
+kfree(void *ptr)
+{
+    struct vm_page *pg;
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    pg = vm_page_lookup(VIRT_TO_PHYS(ptr));
+    if (__TEST(pg->flags, VM_PAGE_SLAB)) {
+        vm_slab_free(pg->slab->cache, ptr);
+    } else if (__TEST(pg->flags, VM_PAGE_LARGE)) {
+        vm_free_pageframe(pg->phys, pg->npages);
+    }
+}
+
+/*
+ * Sets up the cache of caches and
+ * the kmalloc() caches.
+ */
+void
+vm_slab_init(void)
+{
+    char name[VM_SLAB_NAMELEN] = "kmalloc-";
+    size_t size;
+
+    TAILQ_INIT(&cache_list);
+    /* Keep the per-processor parts off each other's cache lines */
+    vm_slab_cache_setup(&cache_cache, "vm_slab_cache",
+                        sizeof(struct vm_slab_cache),
+                        __alignof__(struct vm_slab_cache), NULL, 0);
+    vm_slab_cache_setup(&mag_cache, "vm_slab_mag",
+                        sizeof(struct vm_slab_mag),
+                        __alignof__(struct vm_slab_mag), NULL, 0);
+
+    for (int i = 0; i < KMALLOC_NCACHES; ++i) {
+        size = KMALLOC_MIN << i;
+        itoa(size, &name[8], 10);
+
+        kmalloc_caches[i] = vm_slab_cache_create(name, size, KMALLOC_MIN,
+                                                 NULL);
+        if (kmalloc_caches[i] == NULL) {
+            panic("Could not create kmalloc cache of %d bytes\n", size);
+        }
+    }
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2023 Ian Marco Moffett and the VegaOS team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of VegaOS nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#include <sys/cdefs.h>
+#include <sys/syslog.h>
+#include <sys/vmem.h>
+#include <vm/vm_vmalloc.h>
+#include <vm/vm_physseg.h>
+#include <vm/pmap.h>
+#include <vm/vm.h>
+
+__MODULE_NAME("vm_vmalloc");
+__KERNEL_META("$Vega$: vm_vmalloc.c, Ian Marco Moffett, "
+              "Virtually contiguous kernel allocations");
+
+#if defined(VM_VMALLOC_DEBUG)
+#define DPRINTF(...) KDEBUG(__VA_ARGS__)
+#else
+#define DPRINTF(...) __nothing
+#endif      /* defined(VM_VMALLOC_DEBUG) */
+
+/*
+ * Frames unmapped before each pmap_update() when
+ * tearing down, they can't be freed until then.
+ */
+#define VMALLOC_CHUNK 64
+
+/*
+ * Unmaps up to `npages` from `va`, freeing the frames
+ * behind them. Stops early at the first page that
+ * isn't mapped.
+ *
+ * Returns the number of pages unmapped.
+ */
+static size_t
+vmalloc_unmap(vaddr_t va, size_t npages)
+{
+    struct pmap *pmap = pmap_kernel();
+    paddr_t frames[VMALLOC_CHUNK];
+    size_t n, total = 0;
+    bool done = false;
+
+    while (npages > 0 && !done) {
+        for (n = 0; n < VMALLOC_CHUNK && n < npages; ++n) {
+            if (!pmap_extract(pmap, va, &frames[n])) {
+                done = true;
+                break;
+            }
+
+            pmap_remove(pmap, va);
+            va += PAGE_SIZE;
+        }
+
+        /* Invalidate the whole chunk at once */
+        pmap_update(pmap);
+        for (size_t i = 0; i < n; ++i) {
+            vm_free_pageframe(frames[i], 1);
+        }
+
+        npages -= n;
+        total += n;
+    }
+
+    return total;
+}
+
+/*
+ * Allocates `size` bytes that are virtually contiguous,
+ * backed by single frames from wherever they're free.
+ * Every allocation is followed by an unmapped guard
+ * page, which is also how vfree() finds its end.
+ *
+ * Returns NULL on failure.
+ */
+void *
+vmalloc(size_t size)
+{
+    struct pmap *pmap = pmap_kernel();
+    vmem_addr_t va;
+    uintptr_t frame;
+    size_t npages;
+
+    if (size == 0) {
+        return NULL;
+    }
+
+    npages = __ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE;
+    if (vmem_alloc(&g_kva_arena, (npages + 1) * PAGE_SIZE,
+                   VMEM_INSTANTFIT, &va) != 0) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < npages; ++i) {
+        frame = vm_alloc_pageframe(1, 0);
+        if (frame == 0) {
+            DPRINTF("Out of frames after %d of %d pages\n", i, npages);
+            goto fail;
+        }
+
+        if (pmap_enter(pmap, va + i * PAGE_SIZE, frame, PMAP_WRITABLE) != 0) {
+            vm_free_pageframe(frame, 1);
+            goto fail;
+        }
+    }
+
+    return (void *)va;
+fail:
+    vmalloc_unmap(va, npages);
+    vmem_free(&g_kva_arena, va, (npages + 1) * PAGE_SIZE);
+    return NULL;
+}
+
+/*
+ * Frees memory allocated by vmalloc().
+ */
+void
+vfree(void *ptr)
+{
+    size_t npages;
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    /* Runs up to the guard page */
+    npages = vmalloc_unmap((vaddr_t)ptr, SIZE_MAX);
+    vmem_free(&g_kva_arena, (vaddr_t)ptr, (npages + 1) * PAGE_SIZE);
+}
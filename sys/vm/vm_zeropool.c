@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2023 Ian Marco Moffett and the VegaOS team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of VegaOS nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#include <sys/cdefs.h>
+#include <sys/spinlock.h>
+#include <vm/vm_zeropool.h>
+#include <vm/vm_physseg.h>
+#include <vm/vm_page.h>
+#include <vm/vm.h>
+#include <string.h>
+
+__KERNEL_META("$Vega$: vm_zeropool.c, Ian Marco Moffett, "
+              "Pool of frames zeroed ahead of time");
+
+/*
+ * Frames zeroed while the processor has nothing
+ * better to do, so VM_ALLOC_ZERO allocations
+ * don't have to pay for the memset() themselves.
+ *
+ * The pool is a simple stack, vm_zeropool_work()
+ * tops it up in small batches from the idle loop.
+ */
+static uintptr_t zeropool[VM_ZEROPOOL_SIZE];
+static size_t zeropool_depth = 0;
+static size_t zeropool_hits = 0;
+static size_t zeropool_misses = 0;
+static struct spinlock zeropool_lock = { 0 };
+
+/*
+ * Takes a zeroed frame from the pool.
+ *
+ * Returns the physical address of the frame,
+ * or 0 if the pool is empty; the caller has
+ * to zero a frame itself in that case.
+ */
+uintptr_t
+vm_zeropool_take(void)
+{
+    uintptr_t phys = 0;
+
+    spinlock_acquire(&zeropool_lock);
+    if (zeropool_depth > 0) {
+        phys = zeropool[--zeropool_depth];
+        vm_page_lookup(phys)->flags &= ~VM_PAGE_ZERO;
+        ++zeropool_hits;
+    } else {
+        ++zeropool_misses;
+    }
+    spinlock_release(&zeropool_lock);
+
+    return phys;
+}
+
+/*
+ * Zeroes up to VM_ZEROPOOL_BATCH frames
+ * and adds them to the pool.
+ *
+ * Returns the number of frames added, 0 once the
+ * pool is full (or memory has run out).
+ *
+ * => Meant to be called when idle.
+ */
+size_t
+vm_zeropool_work(void)
+{
+    uintptr_t phys;
+    size_t n;
+
+    for (n = 0; n < VM_ZEROPOOL_BATCH; ++n) {
+        /* Peeking without the lock is fine, the push rechecks */
+        if (zeropool_depth >= VM_ZEROPOOL_SIZE) {
+            break;
+        }
+
+        if ((phys = vm_alloc_pageframe(1, 0)) == 0) {
+            break;
+        }
+
+        memset(PHYS_TO_VIRT(phys), 0, PAGE_SIZE);
+        vm_page_lookup(phys)->flags |= VM_PAGE_ZERO;
+
+        spinlock_acquire(&zeropool_lock);
+        if (zeropool_depth < VM_ZEROPOOL_SIZE) {
+            zeropool[zeropool_depth++] = phys;
+            phys = 0;
+        }
+        spinlock_release(&zeropool_lock);
+
+        if (phys != 0) {
+            /* Filled up behind our back */
+            vm_free_pageframe(phys, 1);
+            break;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Fetches zero pool statistics.
+ */
+void
+vm_zeropool_stats(struct vm_zeropool_stats *res)
+{
+    spinlock_acquire(&zeropool_lock);
+    res->depth = zeropool_depth;
+    res->hits = zeropool_hits;
+    res->misses = zeropool_misses;
+    spinlock_release(&zeropool_lock);
+}